@@ -0,0 +1,205 @@
+/*-----------------------------------------------------------------------------
+    bootloader service table, for apps (bootloader built with BL_SERVICES)
+
+    the bootloader places a table of function pointers at a fixed flash
+    address at the end of the boot section, so an app can use the code the
+    bootloader already has instead of its own copy
+
+    nvmCmd/nvmPage run from the boot section, so they can write to the app
+    section (which app code cannot do on its own)- the app can use them to
+    store its own data in flash (just not over itself)
+
+    uread/uwrite use the bootloader usart, which the app needs to have set up
+    (baud, rx/tx enable, tx pin output), they do not use any bootloader ram
+
+    app use-
+        #define BL_SIZE 2048 //if not 2048, before including this header
+        #include "bl_services.h"
+        if( blServicesOk() ){
+            uint16_t crc = blServices->crc16( 0, v );
+            ...
+            }
+-----------------------------------------------------------------------------*/
+#pragma once
+
+#include <avr/io.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef BL_SIZE
+#define BL_SIZE     2048
+#endif
+
+#define BL_SERVICES_MAGIC   0xB1
+#define BL_SERVICES_VERSION 1
+#define BL_SERVICES_ADDR    (BL_SIZE-16) //flash address, 16 bytes at end of boot section
+
+                typedef struct {
+                    uint8_t magic;      //BL_SERVICES_MAGIC
+                    uint8_t version;    //BL_SERVICES_VERSION, new entries only added to the end
+                    uint16_t (*crc16)(uint16_t crc, uint8_t v); //xmodem crc16, one byte
+                    void (*nvmCmd)(uint8_t cmd); //nvmctrl command (app fills page buffer first)
+                    void (*nvmPage)(volatile uint8_t* dst, const uint8_t* src); //erase/write 1 flash page
+                    uint8_t (*uread)(void); //wait for and return a usart rx byte
+                    void (*uwrite)(const char c); //wait for usart tx ready, then send
+                    uint16_t blVersion; //BL_VERSION, major.minor
+                    }
+bl_services_t   ;
+
+#define blServices  ((const bl_services_t*)(MAPPED_PROGMEM_START + BL_SERVICES_ADDR))
+
+                static inline bool
+blServicesOk    ()
+                {
+                return blServices->magic == BL_SERVICES_MAGIC && blServices->version >= BL_SERVICES_VERSION;
+                }
+
+
+/*-----------------------------------------------------------------------------
+    staged update (bootloader built with BL_STAGE)
+
+    app writes the new image to BL_STAGE_START with blServices->nvmPage
+    (one page at a time), then calls blStageCommit with the image length and
+    its xmodem crc16, then resets- the bootloader checks the crc and copies
+    the image into place
+
+    the image can be up to BL_STAGE_START - BL_SIZE bytes (the app area),
+    and no more than MAPPED_PROGMEM_SIZE - BL_STAGE_START (the staging area,
+    to the end of flash)- the smaller of the two, a longer one is not copied
+    the app itself needs to stay below BL_STAGE_START
+-----------------------------------------------------------------------------*/
+#ifndef BL_STAGE_START
+#define BL_STAGE_START  (BL_SIZE + (MAPPED_PROGMEM_SIZE-BL_SIZE)/2) //flash address
+#endif
+#define BL_STAGE_MAGIC  0x53
+#define BL_STAGE_EE     (EEPROM_END-5) //magic lenL lenH crcH crcL, then the app ok byte
+
+//session log (BL_LOG), ring of 8 byte entries below the last 8 eeprom bytes
+#ifndef BL_LOG_ENTRIES
+#define BL_LOG_ENTRIES  8
+#endif
+#define BL_LOG_SIZE     8
+#define BL_LOG_EE       (EEPROM_END+1-8 - BL_LOG_ENTRIES*BL_LOG_SIZE)
+
+                static inline void
+blStageCommit   (uint16_t len, uint16_t crc)
+                {
+                volatile uint8_t* ee = (volatile uint8_t*)BL_STAGE_EE;
+                while( NVMCTRL.STATUS & 2 ){} //ee is busy
+                ee[0] = BL_STAGE_MAGIC; //all in the same eeprom page, one write
+                ee[1] = len;
+                ee[2] = len>>8;
+                ee[3] = crc>>8;
+                ee[4] = crc;
+                blServices->nvmCmd( 3 ); //ERWP
+                while( NVMCTRL.STATUS & 2 ){}
+                }
+
+
+/*-----------------------------------------------------------------------------
+    background flash check (bootloader built with BL_CRCSCAN)
+
+    the bootloader starts a CRCSCAN background scan before it jumps to the
+    app, call blCrcScanCheck from the app main loop- once the scan is done
+    and the crc did not match, the app is marked as not programmed (the
+    bootloader then waits for an upload) and the mcu resets
+    blCrcScanBad can be used instead to report it some other way
+-----------------------------------------------------------------------------*/
+                //scan done and crc bad (false if the bootloader did not start a scan)
+                static inline bool
+blCrcScanBad    ()
+                {
+                if( CRCSCAN.CTRLB != 0x20 ) return false; //MODE=BACKGROUND, SRC=FLASH, set by bootloader
+                return (CRCSCAN.STATUS & 3) == 0; //not BUSY, not OK
+                }
+
+                static inline void
+blCrcScanCheck  ()
+                {
+                if( ! blCrcScanBad() ) return;
+                volatile uint8_t* ee = (volatile uint8_t*)EEPROM_END; //app ok byte
+                while( NVMCTRL.STATUS & 2 ){} //ee is busy
+                *ee = 0xFF;
+                CCP = 0x9D; NVMCTRL.CTRLA = 3; //ERWP
+                while( NVMCTRL.STATUS & 2 ){}
+                CCP = 0xD8; RSTCTRL.SWRR = 1; //software reset
+                }
+
+
+/*-----------------------------------------------------------------------------
+    handoff record (bootloader built with BL_HANDOFF)
+
+    16 bytes at the top of ram, written by the bootloader before it jumps to
+    the app- ram is not cleared by a reset, so the record also carries the
+    last session over the software reset that ends it
+    both the bootloader and the app need their stack moved below it-
+        -Wl,--defsym=__stack=0x3FEF (RAMEND-16, for a 2k ram part)
+
+    app use-
+        if( blHandoffOk() && (blHandoff->flags & BL_HO_UPDATED) ){
+            log( blHandoff->ticks, blHandoff->blocks );
+            ...
+            }
+-----------------------------------------------------------------------------*/
+#define BL_HANDOFF_MAGIC    0xB2
+#define BL_HANDOFF_ADDR     (RAMEND+1-16)
+
+                typedef struct {
+                    uint8_t magic;      //BL_HANDOFF_MAGIC
+                    uint8_t resetFlags; //RSTCTRL.RSTFR at boot (bootloader clears it)
+                    uint16_t blVersion; //BL_VERSION
+                    uint8_t flags;      //BL_HO_ flags
+                    uint8_t baudStep;   //last session- baud step at the end
+                    uint16_t updates;   //good uploads since power on
+                    uint16_t fails;     //failed upload sessions since power on
+                    uint16_t ticks;     //last session- duration, 1/1024 sec (0xFFFF = 64s or more)
+                    uint16_t blocks;    //last session- data blocks written
+                    uint8_t reserved;
+                    uint8_t check;      //all 16 bytes add up to 0xFF
+                    }
+bl_handoff_t    ;
+
+                enum {
+BL_HO_UPDATED   = 1, //app was just programmed (first boot of this app)
+BL_HO_SESSION   = 2, //a session ran before the reset that got us here
+BL_HO_FAILED    = 4, //that session did not program the app
+BL_HO_PENDING   = 8  //bootloader use- session done, report at next boot
+                };
+
+#define blHandoff   ((volatile bl_handoff_t*)BL_HANDOFF_ADDR)
+
+                static inline uint8_t
+blHandoffSum    ()
+                {
+                uint8_t sum = 0;
+                for( uint8_t i = 0; i < sizeof(bl_handoff_t); i++ ) sum += ((volatile uint8_t*)blHandoff)[i];
+                return sum;
+                }
+
+                static inline bool
+blHandoffOk     ()
+                {
+                return blHandoff->magic == BL_HANDOFF_MAGIC && blHandoffSum() == 0xFF;
+                }
+
+
+/*-----------------------------------------------------------------------------
+    update request
+
+    the last eeprom byte is the app ok byte- 0 = app programmed, 0xFF = no
+    app, BL_EE_REQUEST (or any other value) = app asks for an update and is
+    still intact- a BL_WDT bootloader runs the app again if the session
+    times out
+-----------------------------------------------------------------------------*/
+#define BL_EE_REQUEST   0x01
+
+                static inline void //does not return
+blRequestUpdate ()
+                {
+                volatile uint8_t* ee = (volatile uint8_t*)EEPROM_END;
+                while( NVMCTRL.STATUS & 2 ){} //ee is busy
+                *ee = BL_EE_REQUEST;
+                CCP = 0x9D; NVMCTRL.CTRLA = 3; //ERWP
+                while( NVMCTRL.STATUS & 2 ){}
+                CCP = 0xD8; RSTCTRL.SWRR = 1; //software reset
+                }
@@ -0,0 +1,46 @@
+#!/bin/sh
+# bootloader flash size with each option on (and the options it needs),
+# and the BL_SIZE that holds it- needs avr-gcc and avr-size
+# usage: ./blsize.sh [mcu...]      (attiny3217)
+# a build linked with bl_size.ld fails if it does not fit, for any option
+# set, so this is only to pick BL_SIZE before that happens
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+size(){ # label NAME=VAL...
+    label=$1; shift
+    # BL_SIZE raised so every option links, the size is what is reported
+    cp bootloader.c "$tmp/bl.c"
+    for kv in BL_SIZE=16384 "$@"; do
+        sed -i -E "s/^#define ${kv%%=*}( +)[^ ]+/#define ${kv%%=*}\1${kv#*=}/" "$tmp/bl.c"
+    done
+    if ! avr-gcc -mmcu="$mcu" -Os -I. -o "$tmp/bl.elf" "$tmp/bl.c" 2>"$tmp/err"; then
+        printf '%-28s build failed- %s\n' "$label" "$(grep -m1 error "$tmp/err")"
+        return
+    fi
+    n=$(avr-size "$tmp/bl.elf" | awk 'NR==2 { print $1+$2 }')
+    [ "$base" = 0 ] && base=$n
+    # BL_SERVICES has its 16 byte table at the end of the boot section
+    need=$n
+    case " $* " in *" BL_SERVICES=1 "*) need=$((need+16));; esac
+    need=$(( (need+255)/256*256 ))
+    printf '%-28s %5u bytes  %+5d  BL_SIZE %5u%s\n' "$label" "$n" "$((n-base))" "$need" \
+        "$([ "$need" -gt 2048 ] && echo '  (more than 2048)')"
+}
+for mcu in ${@:-attiny3217}; do
+    base=0
+    echo "$mcu"
+    size "no options"
+    for o in UART_CTS UART_XONXOFF UART_MULTI X_FEC X_PROBE BAUD_ADAPT X_YMODEM \
+             X_ADDR BL_SERVICES BL_WDT X_END X_QUERY BL_LOG BL_HANDOFF BL_CRCSCAN; do
+        size "$o" "$o=1"
+    done
+    size "BL_STAGE (+BL_SERVICES)" BL_STAGE=1 BL_SERVICES=1
+    size "BL_AUTH (+X_YMODEM)" BL_AUTH=1 X_YMODEM=1
+    size "BL_CRYPT (+X_YMODEM)" BL_CRYPT=1 X_YMODEM=1
+    size "BL_AUTH BL_CRYPT X_ADDR" BL_AUTH=1 BL_CRYPT=1 X_YMODEM=1 X_ADDR=1
+    size "BL_AUTH X_END X_QUERY" BL_AUTH=1 X_YMODEM=1 X_END=1 X_QUERY=1
+    size "UART_CTS X_FEC BAUD_ADAPT" UART_CTS=1 X_FEC=1 BAUD_ADAPT=1
+    size "all (no BL_STAGE/UART_MULTI)" UART_XONXOFF=1 X_FEC=1 X_PROBE=1 BAUD_ADAPT=1 \
+        X_YMODEM=1 X_ADDR=1 BL_SERVICES=1 BL_AUTH=1 BL_CRYPT=1 BL_WDT=1 X_END=1 \
+        X_QUERY=1 BL_LOG=1 BL_HANDOFF=1 BL_CRCSCAN=1
+done
@@ -8,6 +8,235 @@
         cpu speed- 16 or 20MHz
         bootloader size
         uart baud rate
+        flow control- none, cts pin, or xon/xoff
+            with flow control the host can stream- send data blocks ahead
+            of the acks (host/blflash and blmulti do, unless BAUD_ADAPT is
+            used), we stop it with cts/xoff while the cpu is halted by a
+            flash write, so there is no round trip per block
+            (host tty set to crtscts or ixon as needed)
+            replies to packets then carry a block number (go-back-n)-
+                ACK blk         blk is written, and all before it
+                NACK next       bad packet, next is the block we want, the
+                                host goes back and sends from there
+                ACK last+1      the EOT
+            a block ahead of the one we want is dropped (the first one
+            after a gap, good or bad, is nacked, the rest are blocks the
+            host sent before it saw our nack), a block behind it is acked
+            again (written, the ack was lost)- the number is escaped in
+            xon/xoff mode
+            without flow control the host waits for each ack (one block in
+            flight), and a block out of sequence cancels the upload
+            the host is stopped before any nvm wait- if a byte arrives
+            within 4 byte times it is still sending, and we keep reading
+            for FLOW_DRAIN_US before the cpu halts (an idle host, waiting
+            for an ack, costs only the 4 byte times)- a usb adapter doing
+            rts/cts in hardware stops within a byte or two, a cdc-acm port
+            doing xon/xoff in the host tty layer only stops after the xoff
+            comes back in a usb frame (1ms) and the writes already queued
+            are out, so 2ms, and FLOW_DRAIN bytes has to hold what arrives
+            in that time at UART_BAUD (checked)- each flash write while
+            streaming waits this long, so lower it for a host known to
+            stop quickly
+            in xon/xoff mode the dump data is escaped- X_ESC followed by
+            the data byte xor 0x20 for any XON, XOFF or X_ESC data byte
+        forward error correction for upload packets (X_FEC)
+            a packet starting with X_SOHF instead of X_SOH has 8 check bytes
+            following the crc- A0H A0L B0H B0L A1H A1L B1H B1L
+            data bytes are split into 2 interleaved codewords (even/odd
+            index), each with a mod 257 fletcher style check-
+                A = sum of data bytes, B = sum of the running A values
+            a single bad byte in each codeword can be corrected, so any
+            error burst up to 2 adjacent bytes is fixed without a NACK
+        link probe commands (X_PROBE), used by host/blprobe to measure the link
+            a command is sent in place of an X_SOH- cmd ~cmd [args]
+            'E' nL nH data[n]   echo n bytes back as they are received
+                                (UART_XONXOFF- XON XOFF X_ESC come back
+                                escaped, 2 bytes, so the host leaves them
+                                out or the echo falls behind the rx)
+            'P' nL nH           send n bytes of lfsr pattern, then crcH crcL
+            'B' step            ack, then switch to baud UART_BAUD>>step (0-3),
+                                host sends 'B' at the new rate within 1 second
+                                to confirm (we ack), else we return to the
+                                previous rate
+        service table for apps (BL_SERVICES)
+            function pointers at a fixed address at the end of the boot
+            section- crc16, nvm command/page write, usart read/write
+            see bl_services.h (used by apps to find and call them)
+        staged update (BL_STAGE)
+            the running app receives a new image at its own pace and writes
+            it to the staging area (BL_STAGE_START to the end of flash) using
+            the service table nvmPage, then writes a marker/length/crc to
+            eeprom (blStageCommit in bl_services.h) and resets
+            at reset we check the staged image crc, copy it page by page to
+            the app start, verify, mark the app as programmed, clear the
+            marker and continue as normal- so the app is only offline for
+            the copy time (needs BL_SERVICES for the app to write flash)
+            the staged image is only checked by its crc, so BL_AUTH cannot
+            be used with it (any app could stage an image)
+        background flash check (BL_CRCSCAN)
+            after an upload we write the crc of the whole flash (except its
+            last 2 bytes) to the last 2 flash bytes (crcH crcL), so the app
+            cannot use those 2 bytes
+            when jumping to the app we start a CRCSCAN background scan of
+            the flash, which runs while the app does- no boot delay
+            the app checks the result with blCrcScanCheck (bl_services.h),
+            which asks for the bootloader and resets on a mismatch
+            crc16 ccitt starting from CRCSCAN_INIT, check the datasheet for
+            your part if the scan always fails
+            the app cannot write its own flash (BL_STAGE, nvmPage from the
+            service table) or the scan will fail
+        session end commands (X_END)
+            after the EOT (and ymodem null header), the image checks and the
+            eeprom writes (may take a while for a big image), we send a ping
+            and wait about 100ms for a command- cmd ~cmd [args]
+            'G'                 run the app now- ACK, then the bootloader
+                                puts back what it changed (usart, pins,
+                                clock, watchdog, rtc) and jumps to the app, no
+                                reset (NACK if no app, or a partial one)
+            'S'                 stay- ACK, then start a new session (ping)
+            'D' mask            dump regions- 1 = sigrow, 2 = fuses,
+                                4 = flash, 8 = eeprom, then wait again
+            with no command, the dumps and reset are done as before
+            (portmux and any UartAltPins changes are left for the app)
+            'G' and 'D' are also taken in place of an X_SOH before a session
+            (after an app query the host can read dumps and run the app
+            without an upload)
+        app query (X_QUERY)
+            'Q' nL nH           reply- app ok byte, crcH crcL of the first n
+                                app bytes (xmodem crc16, n limited to the
+                                app section)
+            the host compares it to its image, and if the app ok byte is not
+            0xFF (0, or an update request) and the crc matches, the upload
+            can be skipped (then 'G' with X_END, or leave the bootloader
+            waiting)
+        session log (BL_LOG)
+            a ring of BL_LOG_ENTRIES 8 byte entries in eeprom, at BL_LOG_EE
+            (bl_services.h, below the staging/app ok bytes)-
+                seq outcome|baudStep<<4 blocksL blocksH nacksL nacksH
+                ticksL ticksH
+            outcome- 0 = app programmed, 1 = failed, 0x0F = never ended
+            (written when the first packet or EOT arrives, so a session cut
+            short by a reset or power loss is still there- commands alone,
+            like a query and run, are not a session and leave no entry)
+            ticks = duration in 1/1024 sec, seq is one more than the
+            previous entry, so the newest entry is the one not followed by
+            seq+1- each session writes its own entry (twice), so the
+            wear is spread over the ring
+            'L' command- the log is sent in the dump data format, and it
+            is also in the eeprom dump
+        handoff record (BL_HANDOFF)
+            a 16 byte record at the top of ram for the app (bl_services.h)-
+            reset flags we saw (RSTCTRL.RSTFR is cleared after), BL_VERSION,
+            good/failed upload counts since power on, and for the last
+            session its duration (rtc, 1/1024 sec), blocks written, the end
+            baud step, and whether the app was just programmed
+            ram survives the reset at the end of a session, a bad check byte
+            (power on) starts the record over
+            both the bootloader and the app need to be linked with the stack
+            below the record (see [5])
+        app ok byte (last eeprom byte)
+            0 = app programmed, 0xFF = no app (or a partial one), any other
+            value = the app asks for an update but is still intact
+            (BL_EE_REQUEST, bl_services.h)- we stay in the bootloader for
+            anything but 0
+        watchdog supervised session (BL_WDT)
+            the watchdog is started (WDT_PERIOD) when the bootloader runs,
+            and only kicked on progress- a data packet acked, a command
+            done, flash pages erased, dump data sent- so a session that
+            stops (host gone, line stuck, a wait that never ends) resets
+            after a WDT_PERIOD at most
+            after a watchdog reset, an intact app (ok byte not 0xFF) is run
+            again and the update request cleared, so a unit asked for an
+            update that never comes is back in its app after WDT_PERIOD
+            (the host needs to start within WDT_PERIOD of the first ping)
+            with no app, the bootloader just starts over
+        bootloader self update- not possible
+            the avr0/1 nvmctrl only lets code in the boot section write the
+            app section (and app code the appdata section), nothing running
+            on the mcu can write the boot section, no matter where the code
+            doing the write lives, so a trampoline in app flash cannot copy a
+            new bootloader into place- a new bootloader needs updi
+            BL_VERSION is in the service table so an app can at least report
+            which bootloader a board has
+        adaptive baud rate (BAUD_ADAPT), host needs the same settings
+            after BAUD_NACK_DOWN data packet NACKs in a row, both ends go to
+            the next lower baud step (after the NACK is sent/received)
+            after BAUD_ACK_UP data packet ACKs in a row, both ends go to the
+            next higher baud step (after the ACK is sent/received)
+            the ACK/NACK of commands and EOT are not counted
+        ymodem style header (X_YMODEM)
+            if the first packet is block 0, it is a header-
+                name NUL length [modtime mode serial ...] NUL ['#' crc]
+            fields are space separated, length and crc in decimal, crc is
+            the xmodem crc16 of the image- our fields follow the NUL that
+            ends the standard ones, after a '#' (a plain ymodem sender like
+            lrzsz sb has zeros there, so its files remaining field is never
+            taken as a crc, and there is then no crc check)
+            an image too big for the app section (below BL_STAGE_START with
+            BL_STAGE, less the last 2 bytes with BL_CRCSCAN) is cancelled
+            (CAN CAN), as is a data packet past it,
+            else the needed pages are erased before the header is acked
+            (may take a while), and data past length is not written
+            after the EOT is acked we send a ping and ack the sender's
+            null header (end of batch)
+            the app is only marked as programmed if the crc matches
+        image authentication (BL_AUTH, needs X_YMODEM)
+            the ymodem header has 2 more '#' fields- mac0 mac1 (decimal), a
+            cbc-mac of the image using speck64/128 with the BL_AUTH_KEY key
+            the mac is calculated as each block is written (starting from a
+            block with the length), so there is nothing to do at boot- the
+            app is only marked as programmed if the mac matches, and
+            entryCheck still only looks at the eeprom byte
+            mac state s[2] (32bit words, little endian bytes)-
+                s = { length, 0 }, encrypt
+                X_SOHA packet- s[0] ^= offset, encrypt
+                data, 8 bytes at a time (last ones 0 padded)- s ^= data,
+                encrypt (data = bytes written, so cut at length)
+            data without a header is cancelled (CAN CAN), and a session
+            without a header and at least one block written is never marked
+            programmed (an EOT alone cannot mark an unchecked image ok), the
+            flash dump leaves out the boot section (the key is in there)
+            note- the key is readable by app code, a symmetric mac keeps out
+            images from elsewhere, not from an app already on the part
+            size- speck (key schedule, 32bit rotates and adds), the mac and
+            the X_YMODEM header parsing it needs do not fit a 2048 byte boot
+            section next to much else- plan on a larger BL_SIZE for BL_AUTH,
+            BL_CRYPT, and more so both (they share speck) with X_ADDR, X_END
+            or X_QUERY, and take the value blsize.sh prints for the options
+            and the compiler used (the bl_size.ld link check stops a build
+            that does not fit)
+        addressed packets (X_ADDR)
+            a packet starting with X_SOHA instead of X_SOH has a 2 byte app
+            offset (little endian, multiple of 128) before the data, which
+            is also included in the crc- X_SOHA blk ~blk offL offH data crc
+            the data is written at that offset and following X_SOH packets
+            continue from there, so a sparse image (host/blflash with a hex
+            or elf file) only needs to send the blocks that have content
+            pages not sent are left as they were, unless a ymodem header
+            had them erased (length = end of the highest block sent)
+            a bad offset cancels the transfer (CAN CAN)
+        encrypted upload (BL_CRYPT, needs X_YMODEM)
+            data packets are encrypted with speck64/128 in ctr mode using
+            the BL_CRYPT_KEY key, the header is not (but needs 4 more '#'
+            fields- mac0 mac1 nonce0 nonce1, mac values 0 if no BL_AUTH)
+            the host picks a new random nonce for each upload
+            keystream for the 8 bytes at app offset off-
+                s = { nonce0 + off/8, nonce1 }, encrypt, s bytes little endian
+            a whole packet is encrypted (padding too), crc is of the
+            encrypted data, mac (BL_AUTH) of the decrypted data
+            the keystream is made while a packet arrives- a speck round at a
+            time while waiting for the next rx byte, never while one is
+            waiting, so no cycle budget is needed- the rx fifo holds 2
+            bytes, so one round and the per byte work (crc16, fec) only
+            have to fit in 2 byte times, a few hundred cycles against 868
+            at 230400 baud and 10MHz- rounds not done by the end of the
+            packet are done before it is decrypted, so a slow cpu or a
+            high baud only delays the ack a little (no rx overrun)
+        fuse write- not possible
+            the tinyavr 0/1 and megaavr 0 nvmctrl take the write fuse
+            command (WFU) from updi only, a cpu write of it does nothing, so
+            nothing running on the mcu can change a fuse- the fuses can be
+            read (the fuses dump, 'D' mask 2), set them with updi
 
     --- [2] ---
     set fuse values as needed
@@ -26,9 +255,32 @@
         if alternate pins are used, also fill in the UartAltPins function body
         to handle setting portmux to use the alternate pins
         a table is provided that maps out pins to uarts for all avr0/1
+        if UART_CTS is enabled, also set the UartCts pin (output to host)
+        if UART_MULTI is enabled, fill in UartList instead of Uart/UartTx/
+        UartRx/UartAltPins- every entry is tried in turn (about 1 second
+        for all), each gets a ping and is then watched for a start bit,
+        the first one to see one is used for the rest of the session, so
+        one bootloader can serve boards wired to different usarts/pins
+        (tx pins are outputs while their entry is tried, so only list
+        pins that are free on every board the binary is used on)
 
     --- [5] ---
     compile and program bootloader
+        link with bl_size.ld so the linker fails if the bootloader does not
+        fit in BL_SIZE, whatever options are on (nothing else checks it
+        when BL_SERVICES is off)-
+            avr-gcc -mmcu=attiny3217 -Os -o bootloader.elf bootloader.c bl_size.ld
+        blsize.sh builds with each option on (and some combinations) and
+        prints the sizes and the BL_SIZE each one needs, for one or more
+        mcus- run it after changing the code, the options or the compiler
+        if BL_SERVICES is enabled, the service table section needs to be
+        placed at BL_SERVICES_ADDR (see bl_services.h), for BL_SIZE 2048-
+            -Wl,--section-start=.blservices=0x7F0
+        the linker will then also complain if the bootloader code grows into
+        the table
+        if BL_HANDOFF is enabled, link the bootloader and the apps with the
+        stack below the record (BL_HANDOFF_ADDR), for a 2k ram part-
+            -Wl,--defsym=__stack=0x3FEF
 
 -----------------------------------------------------------------------------*/
 
@@ -38,6 +290,34 @@
 #define FREQSEL     2           // OSC20M speed- 1==16MHz, 2=20MHz
 #define BL_SIZE     2048        // value divisible by 256, used in FUSES
 #define UART_BAUD   230400      // will be checked to see if possible
+#define UART_CTS    0           // 1 = use UartCts pin for hardware flow control
+#define UART_XONXOFF 0          // 1 = use xon/xoff software flow control
+#define UART_MULTI  0           // 1 = listen on all UartList usarts/pins, use the first active
+#define FLOW_DRAIN  64          // rx buffer for bytes the host sends after we stop it (1-255)
+#define FLOW_DRAIN_US 2000      // time the host may take to stop (usb- a 1ms frame or more)
+#define X_FEC       0           // 1 = accept X_SOHF packets with error correction
+#define X_PROBE     0           // 1 = enable link probe commands (echo, pattern, baud)
+#define BAUD_ADAPT  0           // 1 = change baud step from the data packet ack/nack streaks
+#define BAUD_NACK_DOWN 3        // nacks in a row to go down a baud step (1-255)
+#define BAUD_ACK_UP 32          // acks in a row to go up a baud step (1-255)
+#define X_YMODEM    0           // 1 = accept a ymodem style block 0 header
+#define X_ADDR      0           // 1 = accept X_SOHA packets with a flash offset
+#define BL_SERVICES 0           // 1 = export a service table for apps (bl_services.h)
+#define BL_STAGE    0           // 1 = copy an image the app staged in flash into place
+#define BL_AUTH     0           // 1 = only mark the app programmed if its mac matches
+#define BL_AUTH_KEY 0x03020100,0x0B0A0908,0x13121110,0x1B1A1918 // speck64/128 key words (change!)
+#define BL_CRYPT    0           // 1 = upload data is encrypted (speck ctr)
+#define BL_CRYPT_KEY 0x13121110,0x1B1A1918,0x03020100,0x0B0A0908 // speck64/128 key words (change!)
+#define BL_WDT      0           // 1 = watchdog supervised session, a stopped session resets
+#define WDT_PERIOD  0x0B        // WDT.CTRLA PERIOD- 0x09 = 2s, 0x0A = 4s, 0x0B = 8s
+#define X_END       0           // 1 = session end commands (run app, stay, select dumps)
+#define X_QUERY     0           // 1 = enable the app query command (host skips a current app)
+#define BL_LOG      0           // 1 = keep a log of the sessions in eeprom
+#define BL_LOG_ENTRIES 8        // log size, 8 bytes each (eeprom below the app ok byte)
+#define BL_HANDOFF  0           // 1 = leave a handoff record for the app at the top of ram
+#define BL_CRCSCAN  0           // 1 = start a background flash crc scan when running the app
+#define CRCSCAN_INIT 0xFFFF     // crc start value the CRCSCAN peripheral uses
+//#define BL_STAGE_START 0x4400 // flash address of the staging area (default- bl_services.h)
 // ----------
 
 
@@ -46,6 +326,9 @@
 // allows higher speeds for uart but still within speed limits for 3.3v power
 #define F_CPU       (FREQSEL==2 ? 10000000ul : 8000000ul)
 //=============================================================================
+// bootloader version, major.minor (in the service table, so apps can see it)
+#define BL_VERSION  0x0100
+//=============================================================================
 // check for valid define values
 #if FREQSEL != 2 && FREQSEL != 1
 #error "FREQSEL required to be 1 or 2"
@@ -56,12 +339,67 @@
 #if (F_CPU*4/UART_BAUD) < 64
 #error "UART_BAUD value is too high for cpu speed"
 #endif
+#if (X_PROBE || BAUD_ADAPT) && ((F_CPU*4/UART_BAUD)<<3) > 0xFFFF
+#error "UART_BAUD value is too low for the lowest baud step"
+#elif (F_CPU*4/UART_BAUD) > 0xFFFF
+#error "UART_BAUD value is too low for cpu speed"
+#endif
+#if FLOW_DRAIN < 1 || FLOW_DRAIN > 255
+#error "FLOW_DRAIN needs to be 1-255"
+#endif
+#if (UART_CTS || UART_XONXOFF) && (UART_BAUD/10)*FLOW_DRAIN_US/1000000 > FLOW_DRAIN
+#error "FLOW_DRAIN too small for what arrives in FLOW_DRAIN_US at UART_BAUD"
+#endif
+#if FLOW_DRAIN_US*(F_CPU/1000000)/10 > 0xFFFF
+#error "FLOW_DRAIN_US too high"
+#endif
+#if BAUD_NACK_DOWN < 1 || BAUD_NACK_DOWN > 255 || BAUD_ACK_UP < 1 || BAUD_ACK_UP > 255
+#error "BAUD_NACK_DOWN and BAUD_ACK_UP need to be 1-255"
+#endif
 //=============================================================================
 
 #include <avr/io.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <util/delay.h>
+#include "bl_services.h"
+
+#if BL_STAGE && ! BL_SERVICES
+#error "BL_STAGE needs BL_SERVICES (the app writes the staging area with it)"
+#endif
+#if BL_AUTH && ! X_YMODEM
+#error "BL_AUTH needs X_YMODEM (the mac is in the header)"
+#endif
+#if BL_CRYPT && ! X_YMODEM
+#error "BL_CRYPT needs X_YMODEM (the nonce is in the header)"
+#endif
+#if UART_MULTI && BL_SERVICES
+#error "UART_MULTI cannot be used with BL_SERVICES (service uread/uwrite need a fixed usart)"
+#endif
+#if BL_CRCSCAN && BL_STAGE
+#error "BL_CRCSCAN cannot be used with BL_STAGE (the app writes its own flash)"
+#endif
+#if BL_AUTH && BL_STAGE
+#error "BL_AUTH cannot be used with BL_STAGE (a staged image only has a crc, no mac)"
+#endif
+#if BL_STAGE && (BL_STAGE_START % 128 || BL_STAGE_START <= BL_SIZE)
+#error "BL_STAGE_START needs to be above BL_SIZE and divisible by 128"
+#endif
+#if BL_STAGE && BL_STAGE_START >= MAPPED_PROGMEM_SIZE
+#error "BL_STAGE_START needs to be inside the flash (below MAPPED_PROGMEM_SIZE)"
+#endif
+//app bytes an upload can use- below the staging area, or all but the crc
+#if BL_STAGE
+#define APP_MAX     (BL_STAGE_START - BL_SIZE)
+#elif BL_CRCSCAN
+#define APP_MAX     (MAPPED_PROGMEM_SIZE - BL_SIZE - 2)
+#else
+#define APP_MAX     (MAPPED_PROGMEM_SIZE - BL_SIZE)
+#endif
+//BL_SIZE as a linker symbol, for the size check in bl_size.ld
+#define BL_STR_(v)  #v
+#define BL_STR(v)   BL_STR_(v)
+asm( ".global __bl_size\n .equ __bl_size, " BL_STR(BL_SIZE) );
 
 
 
@@ -135,16 +473,44 @@ Sw              = { &PORTB, 7, 1<<7, 0 };
 // --- [4] ---
                 //uart info
 
+                #if UART_MULTI == 0
                 static USART_t* const
 Uart            = &USART0;
                 static const pin_t
 UartTx          = { &PORTB, 2, 1<<2, 0 }; //onVal value unimportant
                 static const pin_t
 UartRx          = { &PORTB, 3, 1<<3, 0 }; //onVal value unimportant
+                #endif
+                //cts output to host (only used if UART_CTS is 1)
+                //onVal is the level that tells the host it can send (rs232 cts is low)
+                __attribute(( unused )) static const pin_t
+UartCts         = { &PORTB, 0, 1<<0, 0 };
                 //set function to handle enabling the alternate pins if needed
                 //else leave as a blank function
                 static void
 UartAltPins     (){} // { PORTMUX.USARTROUTEA = 1<<0; /*mega0 USART0 alt pins*/ }
+
+                //UART_MULTI- usart, tx pin, rx pin, portmux register, mask, value
+                typedef struct {
+                    USART_t* usart;
+                    pin_t tx;
+                    pin_t rx;
+                    volatile uint8_t* mux;
+                    uint8_t muxMask;
+                    uint8_t muxVal;
+                    }
+uart_t          ;
+                __attribute(( unused )) static const uart_t
+UartList        [] = {
+                //avr0/1 tiny, default and alternate pins
+                { &USART0, { &PORTB, 2, 1<<2, 0 }, { &PORTB, 3, 1<<3, 0 }, &PORTMUX.CTRLB, 1, 0 },
+                { &USART0, { &PORTA, 1, 1<<1, 0 }, { &PORTA, 2, 1<<2, 0 }, &PORTMUX.CTRLB, 1, 1 },
+                //mega0, default pins (alternate- pin+4, muxVal 1<<(N*2))
+                //{ &USART0, { &PORTA, 0, 1<<0, 0 }, { &PORTA, 1, 1<<1, 0 }, &PORTMUX.USARTROUTEA, 3<<0, 0 },
+                //{ &USART1, { &PORTC, 0, 1<<0, 0 }, { &PORTC, 1, 1<<1, 0 }, &PORTMUX.USARTROUTEA, 3<<2, 0 },
+                //{ &USART2, { &PORTF, 0, 1<<0, 0 }, { &PORTF, 1, 1<<1, 0 }, &PORTMUX.USARTROUTEA, 3<<4, 0 },
+                //{ &USART3, { &PORTB, 0, 1<<0, 0 }, { &PORTB, 1, 1<<1, 0 }, &PORTMUX.USARTROUTEA, 3<<6, 0 },
+                };
 // ----------
 
 
@@ -155,10 +521,32 @@ X_NACK          = 0x15,
 X_ACK           = 0x06,
 X_SOH           = 0x01,
 X_EOT           = 0x04,
-X_PING          = 'C' //to host, C = xmodem-crc (NACK = normal xmodem)
+X_CAN           = 0x18, //cancel (image too big, bad offset, block out of sequence without flow control)
+X_SOHF          = 0x0E, //SOH with forward error correction (X_FEC)
+X_SOHA          = 0x12, //SOH with a flash offset (X_ADDR)
+X_PING          = 'C', //to host, C = xmodem-crc (NACK = normal xmodem)
+X_XON           = 0x11, //flow control (UART_XONXOFF)
+X_XOFF          = 0x13,
+X_ESC           = 0x7D  //escape for dump data (UART_XONXOFF)
+                };
+                enum { //commands, sent in place of X_SOH
+X_CMD_ECHO      = 'E', //X_PROBE
+X_CMD_PATTERN   = 'P', //X_PROBE
+X_CMD_BAUD      = 'B', //X_PROBE
+X_CMD_LOG       = 'L', //BL_LOG
+X_CMD_GO        = 'G', //X_END
+X_CMD_STAY      = 'S', //X_END
+X_CMD_DUMP      = 'D', //X_END
+X_CMD_QUERY     = 'Q'  //X_QUERY
+                };
+                enum { //nvmctrl commands
+NVM_WP          = 1, //write page
+NVM_ER          = 2, //erase page
+NVM_ERWP        = 3  //erase/write page
                 };
                 enum {
-X_DATA_SIZE     = 128
+X_DATA_SIZE     = 128,
+BAUD_STEPS      = 4 //UART_BAUD>>0 to UART_BAUD>>3
                 };
 
                 // constants
@@ -174,6 +562,44 @@ appMemStart     = (volatile uint8_t*)(MAPPED_PROGMEM_START|BL_SIZE);
 
                 uint8_t
 xmodemData      [X_DATA_SIZE]; //storage for an xmodem data packet (always 128 in size)
+                uint8_t
+xmodemBlock     ; //block number of the xmodem data packet
+                uint8_t
+xmodemType      ; //start char of the xmodem data packet (X_SOH, X_SOHF, X_SOHA)
+                #if X_ADDR
+                uint16_t
+xmodemAddr      ; //app offset from an X_SOHA packet
+                #endif
+                uint8_t
+lastBlock       ; //last data block written (a repeat is a resend after our ack was lost)
+                #if UART_CTS || UART_XONXOFF
+                bool
+xnacked         ; //streaming- nacked, blocks ahead are dropped until the host goes back
+                #endif
+                uint8_t
+resetFlags      ; //RSTCTRL.RSTFR at boot
+                #if BL_HANDOFF || BL_LOG
+                uint16_t
+sessBlocks, sessNacks, sessTicks; //session stats (ticks = 1/1024 sec)
+                #endif
+                uint8_t
+baudStep        ; //0 = UART_BAUD, each step is half the rate
+                #if BAUD_ADAPT
+                uint8_t
+ackStreak, nackStreak; //data packet ack/nack counts in a row
+                #endif
+                #if UART_MULTI
+                static USART_t*
+Uart            ; //from the UartList entry in use
+                static pin_t
+UartTx, UartRx  ;
+                #endif
+                #if UART_CTS || UART_XONXOFF
+                uint8_t
+rxBuf           [FLOW_DRAIN]; //rx bytes collected after flow stopped
+                uint8_t
+rxCount, rxIdx  ;
+                #endif
 
                 //functions
 
@@ -203,8 +629,31 @@ ledTog          ()
                 static void //software reset
 softReset       () { CCP = 0xD8; RSTCTRL.SWRR = 1; }
 
+                static void //waits for any previous flash/eeprom write first
+nvmCmd          (uint8_t cmd)
+                {
+                while( NVMCTRL.STATUS & 3 ){} //flash/ee busy
+                CCP = 0x9D; NVMCTRL.CTRLA = cmd;
+                }
+
                 static void
-nvmWrite        () { CCP = 0x9D; NVMCTRL.CTRLA = 3; } //ERWP
+nvmWrite        () { nvmCmd( NVM_ERWP ); }
+
+                __attribute(( unused )) static void //dst = mapped flash address of a page, erase/write src to it
+nvmPage         (volatile uint8_t* dst, const uint8_t* src)
+                {
+                for( uint8_t i = 0; i < MAPPED_PROGMEM_PAGE_SIZE; i++ ) dst[i] = src[i];
+                nvmWrite();
+                }
+
+                static void //write 1 eeprom byte
+eeWrite         (volatile uint8_t* p, uint8_t v)
+                {
+                while( NVMCTRL.STATUS & 2 ){} //ee is busy (page buffer in use)
+                *p = v; //write to eeprom page buffer
+                nvmWrite(); //write eeprom
+                while( NVMCTRL.STATUS & 2 ){} //ee is busy
+                }
 
                 static bool //we enabled falling edge sense, so any rx will set the rx intflag
 isRxActive      () //will clear flag, so can also use to just clear flag
@@ -215,19 +664,80 @@ isRxActive      () //will clear flag, so can also use to just clear flag
                 }
 
                 static bool //return true if we want to stay in bootloader
-entryCheck      () { return *eeLastBytePtr == 0xFF || swIsOn() || *appMemStart == 0xFF; }
+entryCheck      ()
+                {
+                uint8_t ok = *eeLastBytePtr; //0 = ok, 0xFF = no app, else update request
+                if( ok == 0xFF || *appMemStart == 0xFF ) return true; //no app
+                #if BL_WDT
+                if( resetFlags & 0x08 ){ //WDRF, a session timed out but the app is intact
+                    if( ok ) eeWrite( eeLastBytePtr, 0 ); //drop the request
+                    return false;
+                    }
+                #endif
+                return ok || swIsOn();
+                }
+
+                static void //protocol progress (BL_WDT)
+wdtKick         ()
+                {
+                #if BL_WDT
+                asm( "wdr" );
+                #endif
+                }
 
                 static void
-init            ()
+baudSet         (uint8_t step)
                 {
-                CCP = 0xD8; CLKCTRL.MCLKCTRLB = 1; //prescale enable, div2 (8Mhz or 10Mhz)
-                Uart->BAUD = F_CPU*4/UART_BAUD;
+                baudStep = step;
+                Uart->BAUD = (F_CPU*4/UART_BAUD)<<step;
+                }
+
+                static void
+uartOn          ()
+                {
+                baudSet( baudStep );
                 Uart->CTRLB = 0xC0; //RXEN,TXEN
                 UartTx.port->DIRSET = UartTx.pinbm; //output
                 (&UartRx.port->PIN0CTRL)[UartRx.pin] = 0x08|0x03; //pullup, falling edge sense
                 UartAltPins(); //function to handle alternate pins if needed
                 }
 
+                #if UART_MULTI
+                enum { UART_COUNT = sizeof(UartList)/sizeof(UartList[0]) };
+
+                static void //switch to a UartList entry (previous one back to inputs, usart off)
+uartUse         (uint8_t i)
+                {
+                if( Uart ){
+                    Uart->CTRLB = 0;
+                    UartTx.port->DIRCLR = UartTx.pinbm;
+                    (&UartRx.port->PIN0CTRL)[UartRx.pin] = 0;
+                    }
+                const uart_t* u = &UartList[i];
+                Uart = u->usart;
+                UartTx = u->tx;
+                UartRx = u->rx;
+                *u->mux = (*u->mux & ~u->muxMask) | u->muxVal;
+                uartOn();
+                }
+                #else
+                enum { UART_COUNT = 1 };
+                #endif
+
+                static void
+init            ()
+                {
+                CCP = 0xD8; CLKCTRL.MCLKCTRLB = 1; //prescale enable, div2 (8Mhz or 10Mhz)
+                #if UART_MULTI
+                uartUse( 0 );
+                #else
+                uartOn();
+                #endif
+                #if BL_WDT
+                CCP = 0xD8; WDT.CTRLA = WDT_PERIOD; //session has to make progress
+                #endif
+                }
+
                 static void
 uwrite          (const char c)
                 {
@@ -235,24 +745,110 @@ uwrite          (const char c)
                 Uart->TXDATAL = c;
                 }
 
+                __attribute(( unused )) static void //wait for all tx data to be sent (before changing baud)
+utxDone         () //call right after a uwrite, last byte is then in the shift register
+                {
+                while( (Uart->STATUS & 0x20) == 0 ){} //DREIF
+                Uart->STATUS = 0x40; //clear TXCIF
+                while( (Uart->STATUS & 0x40) == 0 ){} //TXCIF
+                }
+
                 static uint8_t
 uread           ()
                 {
+                #if UART_CTS || UART_XONXOFF
+                if( rxIdx < rxCount ){ //first use any bytes collected in flowOff
+                    uint8_t c = rxBuf[rxIdx++];
+                    if( rxIdx == rxCount ) rxIdx = rxCount = 0;
+                    return c;
+                    }
+                #endif
                 while ( (Uart->STATUS & 0x80) == 0 ){} //RXC
                 return Uart->RXDATAL;
                 }
 
+                __attribute(( unused )) static int16_t //uread with timeout, t = loop count (about 10 clocks each)
+ureadTimeout    (uint32_t t) //returns -1 if timed out
+                {
+                #if UART_CTS || UART_XONXOFF
+                if( rxIdx < rxCount ) return uread();
+                #endif
+                while( t-- ) if( Uart->STATUS & 0x80 ) return Uart->RXDATAL; //RXC
+                return -1;
+                }
+
+                static void //write data byte, escaped if using xon/xoff
+uwriteEsc       (const uint8_t c)
+                {
+                #if UART_XONXOFF
+                if( c == X_XON || c == X_XOFF || c == X_ESC ){
+                    uwrite( X_ESC );
+                    uwrite( c ^ 0x20 );
+                    return;
+                    }
+                #endif
+                uwrite( c );
+                }
+
+                static void //host can send
+flowOn          ()
+                {
+                #if UART_CTS
+                UartCts.port->DIRSET = UartCts.pinbm;
+                if(UartCts.onVal) UartCts.port->OUTSET = UartCts.pinbm;
+                else UartCts.port->OUTCLR = UartCts.pinbm;
+                #endif
+                #if UART_XONXOFF
+                uwrite( X_XON );
+                #endif
+                }
+
+                static void //host stops sending
+flowOff         ()
+                {
+                #if UART_CTS
+                if(UartCts.onVal) UartCts.port->OUTCLR = UartCts.pinbm;
+                else UartCts.port->OUTSET = UartCts.pinbm;
+                #endif
+                #if UART_XONXOFF
+                uwrite( X_XOFF );
+                #endif
+                #if UART_CTS || UART_XONXOFF
+                //the host will not stop instantly (usb adapters can take a while)-
+                //nothing in 4 byte times and it was not sending (waiting for an
+                //ack), else collect what is still arriving for FLOW_DRAIN_US
+                //while loop about 10 clocks
+                uint16_t t = (F_CPU*4/UART_BAUD)<<baudStep;
+                bool sending = false;
+                while( t-- ){
+                    if( (Uart->STATUS & 0x80) == 0 ) continue; //RXC
+                    uint8_t c = Uart->RXDATAL;
+                    if( rxCount < FLOW_DRAIN ) rxBuf[rxCount++] = c;
+                    if( sending ) continue;
+                    sending = true;
+                    t = FLOW_DRAIN_US*(F_CPU/1000000)/10;
+                    }
+                #endif
+                }
+
                 static void
 dumpMem         (uint16_t addr, uint16_t size){
-                uwrite( addr & 0xFF ); //header- addrL addrH sizeL sizeH
-                uwrite( addr >> 8 );
-                uwrite( size & 0xFF );
-                uwrite( size >> 8 );
+                uwriteEsc( addr & 0xFF ); //header- addrL addrH sizeL sizeH
+                uwriteEsc( addr >> 8 );
+                uwriteEsc( size & 0xFF );
+                uwriteEsc( size >> 8 );
                 volatile uint8_t* ptr = (volatile uint8_t*)addr; 
-                while( size-- ) uwrite(*ptr++);
+                while( size-- ){ wdtKick(); uwriteEsc(*ptr++); }
                 }
                 static void
-dumpFlash       () { dumpMem( MAPPED_PROGMEM_START, MAPPED_PROGMEM_SIZE ); }
+dumpFlash       () //not the boot section if it has the mac key
+                {
+                #if BL_AUTH
+                dumpMem( MAPPED_PROGMEM_START+BL_SIZE, MAPPED_PROGMEM_SIZE-BL_SIZE );
+                #else
+                dumpMem( MAPPED_PROGMEM_START, MAPPED_PROGMEM_SIZE );
+                #endif
+                }
                 static void
 dumpEeprom      () { dumpMem( MAPPED_EEPROM_START, MAPPED_EEPROM_SIZE ); }
                 static void
@@ -260,6 +856,17 @@ dumpFuses       () { dumpMem( FUSES_START, FUSE_MEMORY_SIZE ); }
                 static void
 dumpSigrow      () { dumpMem( (uint16_t)&SIGROW, sizeof(SIGROW_t) ); }
 
+                #if X_END
+                static void //X_CMD_DUMP mask- 1 = sigrow, 2 = fuses, 4 = flash, 8 = eeprom
+dumpSelect      (uint8_t mask)
+                {
+                if( mask & 1 ) dumpSigrow();
+                if( mask & 2 ) dumpFuses();
+                if( mask & 4 ) dumpFlash();
+                if( mask & 8 ) dumpEeprom();
+                }
+                #endif
+
                 static void
 Xbroadcast      ()
                 {
@@ -267,13 +874,21 @@ Xbroadcast      ()
                 //we do not know if sender is ready yet (may not see our C),
                 //so to get things started send out a C (PING) every second or so until
                 //we see the first rx start bit
+                //(UART_MULTI- on each UartList entry in turn, the one that sees the
+                //start bit stays in use)
                 while(1){
                     ledTog(); //blink when waiting for sender
-                    uwrite( X_PING );
-                    uint32_t t = F_CPU/10; //count to wait (while loop about 10 clocks)
-                    bool rx;
-                    while( rx = isRxActive(), t-- && !rx ){}
-                    if( rx ) break;
+                    for( uint8_t i = 0; i < UART_COUNT; i++ ){
+                        #if UART_MULTI
+                        if( UART_COUNT > 1 ) uartUse( i );
+                        isRxActive(); //clear, pullup just turned on
+                        #endif
+                        uwrite( X_PING );
+                        uint32_t t = F_CPU/10/UART_COUNT; //count to wait (while loop about 10 clocks)
+                        bool rx;
+                        while( rx = isRxActive(), t-- && !rx ){}
+                        if( rx ) return;
+                        }
                     }
                 }
 
@@ -289,6 +904,262 @@ crc16           (uint16_t crc, uint8_t v)
                 return crc;
                 }
 
+                static void //data packet ok
+xack            ()
+                {
+                wdtKick();
+                uwrite( X_ACK );
+                #if UART_CTS || UART_XONXOFF
+                uwriteEsc( xmodemBlock ); //streaming- this block (and all before it) is written
+                #endif
+                #if BAUD_ADAPT
+                nackStreak = 0;
+                if( ++ackStreak < BAUD_ACK_UP ) return;
+                ackStreak = 0;
+                if( baudStep == 0 ) return;
+                utxDone(); //ack sent at the current rate, then go up
+                baudSet( baudStep-1 );
+                #endif
+                }
+
+                static void //data packet bad
+xnack           ()
+                {
+                #if UART_CTS || UART_XONXOFF
+                //streaming- one nack per gap, a bad block ahead of the one we
+                //want was sent before the host saw it (the wanted one is nacked
+                //every time, it is the resend)
+                uint8_t ahead = xmodemBlock - lastBlock;
+                if( xnacked && ahead >= 2 && ahead < 128 ) return;
+                #endif
+                uwrite( X_NACK );
+                #if UART_CTS || UART_XONXOFF
+                uwriteEsc( lastBlock+1 ); //streaming- host goes back to the block we want
+                xnacked = true;
+                #endif
+                #if BL_HANDOFF || BL_LOG
+                sessNacks++;
+                #endif
+                #if BAUD_ADAPT
+                ackStreak = 0;
+                if( ++nackStreak < BAUD_NACK_DOWN ) return;
+                nackStreak = 0;
+                if( baudStep == BAUD_STEPS-1 ) return;
+                utxDone(); //nack sent at the current rate, then go down
+                baudSet( baudStep+1 );
+                #endif
+                }
+
+                __attribute(( unused )) static uint16_t //2 byte little endian value (command args)
+uread16         () { uint16_t v = uread(); return v | (uread()<<8); }
+
+                #if X_END
+                static void appGo(); //session end commands, below
+                #endif
+
+                static void
+command         (uint8_t c) //c = command, already read
+                {
+                switch( c ){
+                    #if X_PROBE
+                    case X_CMD_ECHO: case X_CMD_PATTERN: case X_CMD_BAUD: break;
+                    #endif
+                    #if BL_LOG
+                    case X_CMD_LOG: break;
+                    #endif
+                    #if X_END
+                    case X_CMD_GO: case X_CMD_DUMP: break;
+                    #endif
+                    #if X_QUERY
+                    case X_CMD_QUERY: break;
+                    #endif
+                    default: return; //not a command, ignore
+                    }
+                //command byte could be noise, so also needs its inverse to follow
+                if( (uint8_t)(uread() + c) != 255 ) return;
+                wdtKick();
+
+                #if X_PROBE
+                if( c == X_CMD_ECHO ){ //nL nH data[n], echo data as received
+                    uint16_t n = uread16();
+                    while( n-- ){ wdtKick(); uwriteEsc( uread() ); } //can run longer than WDT_PERIOD
+                    }
+                else if( c == X_CMD_PATTERN ){ //nL nH, send n pattern bytes + crc
+                    uint16_t n = uread16();
+                    uint16_t crc = 0;
+                    uint8_t v = 1;
+                    while( n-- ){ //8bit galois lfsr, 1-255
+                        wdtKick();
+                        v = (v & 1) ? (v>>1) ^ 0xB8 : v>>1;
+                        uwriteEsc( v );
+                        crc = crc16( crc, v );
+                        }
+                    uwriteEsc( crc>>8 );
+                    uwriteEsc( crc );
+                    }
+                else if( c == X_CMD_BAUD ){ //step, confirm at new rate or go back
+                    uint8_t step = uread();
+                    if( step >= BAUD_STEPS ){ uwrite( X_NACK ); return; }
+                    uint8_t prev = baudStep;
+                    uwrite( X_ACK );
+                    utxDone(); //ack sent before changing rate
+                    baudSet( step );
+                    int16_t r; //ignore any glitch bytes from the host changing its rate
+                    while( (r = ureadTimeout(F_CPU/10)) >= 0 ){
+                        if( r == X_CMD_BAUD ){ uwrite( X_ACK ); return; }
+                        }
+                    baudSet( prev ); //no confirm, go back to previous rate
+                    }
+                #endif
+                #if BL_LOG
+                if( c == X_CMD_LOG ) dumpMem( BL_LOG_EE, BL_LOG_ENTRIES*BL_LOG_SIZE );
+                #endif
+                #if X_END
+                if( c == X_CMD_GO ) appGo(); //returns only if no app
+                if( c == X_CMD_DUMP ) dumpSelect( uread() );
+                #endif
+                #if X_QUERY
+                if( c == X_CMD_QUERY ){ //nL nH, app ok byte, crc of n app bytes
+                    uint16_t n = uread16();
+                    uint16_t max = MAPPED_PROGMEM_SIZE - BL_SIZE;
+                    if( n > max ) n = max;
+                    uint16_t crc = 0;
+                    for( uint16_t i = 0; i < n; i++ ) crc = crc16( crc, appMemStart[i] );
+                    uwriteEsc( *eeLastBytePtr );
+                    uwriteEsc( crc>>8 );
+                    uwriteEsc( crc );
+                    }
+                #endif
+                }
+
+                #if X_FEC
+                enum { FEC_WAYS = 2, FEC_N = X_DATA_SIZE/FEC_WAYS }; //interleave, symbols per codeword
+
+                static uint16_t //mod 257 add, both values < 257
+fecAdd          (uint16_t a, uint16_t b) { a += b; return a >= 257 ? a - 257 : a; }
+
+                //a,b = sent minus calculated check values for one codeword (mod 257)
+                //a is the error value, b is the error value times the weight of the
+                //bad byte (weights are FEC_N down to 1), so find the weight and fix
+                static bool
+fecFix          (uint16_t a, uint16_t b, uint8_t way)
+                {
+                if( a == 0 ) return b == 0; //nothing to fix, or more than 1 bad byte
+                uint16_t wa = 0;
+                for( uint8_t w = 1; w <= FEC_N; w++ ){
+                    wa = fecAdd( wa, a );
+                    if( wa != b ) continue;
+                    uint8_t* p = &xmodemData[(FEC_N-w)*FEC_WAYS + way];
+                    uint16_t v = fecAdd( *p, a );
+                    if( v > 255 ) return false; //not a valid byte value, so not a single error
+                    *p = v;
+                    return true;
+                    }
+                return false;
+                }
+                #endif
+
+                #if BL_AUTH || BL_CRYPT
+                //speck64/128, encrypt only (cbc-mac, ctr keystream)
+                enum { SPECK_ROUNDS = 27 };
+
+                static uint32_t
+ror8            (uint32_t v) { return (v>>8) | (v<<24); }
+                static uint32_t
+rol3            (uint32_t v) { return (v<<3) | (v>>29); }
+
+                static void //s[0] = y, s[1] = x
+speckRound      (uint32_t* s, uint32_t k)
+                {
+                s[1] = (ror8(s[1]) + s[0]) ^ k;
+                s[0] = rol3(s[0]) ^ s[1];
+                }
+
+                static void //key = k0 l0 l1 l2
+speckKey        (const uint32_t* key, uint32_t* rk)
+                {
+                uint32_t k = key[0];
+                uint32_t l[3] = { key[1], key[2], key[3] };
+                for( uint8_t i = 0; i < SPECK_ROUNDS; i++ ){
+                    rk[i] = k;
+                    uint32_t* lp = &l[i%3];
+                    *lp = (ror8(*lp) + k) ^ i;
+                    k = rol3(k) ^ *lp;
+                    }
+                }
+
+                __attribute(( unused )) static void
+speckEnc        (uint32_t* s, const uint32_t* rk)
+                {
+                for( uint8_t i = 0; i < SPECK_ROUNDS; i++ ) speckRound( s, rk[i] );
+                }
+                #endif
+
+                #if BL_CRYPT
+                static const uint32_t
+cryptKey        [4] = { BL_CRYPT_KEY };
+                uint32_t
+cryptRk         [SPECK_ROUNDS];
+                uint32_t
+cryptNonce      [2]; //from the ymodem header
+                uint16_t
+cryptNext       ; //app offset the next X_SOH packet is written to
+                uint8_t
+cryptKs         [X_DATA_SIZE]; //keystream for the packet being received
+                uint32_t
+cryptS          [2]; //keystream block in progress
+                uint16_t
+cryptCtr        ; //counter of the keystream block in progress (app offset/8)
+                uint8_t
+cryptRound, cryptChunk; //progress, chunk = 8 byte keystream block
+
+                static void //counter block- nonce0+ctr nonce1
+cryptLoad       () { cryptS[0] = cryptNonce[0] + cryptCtr; cryptS[1] = cryptNonce[1]; }
+
+                static void //start the keystream for a packet at app offset off
+cryptStart      (uint16_t off)
+                {
+                cryptRound = cryptChunk = 0;
+                cryptCtr = off/8;
+                cryptLoad();
+                }
+
+                //one speck round of the packet keystream (16 chunks * 27 rounds)
+                static void
+cryptStep       ()
+                {
+                if( cryptChunk >= X_DATA_SIZE/8 ) return; //done
+                speckRound( cryptS, cryptRk[cryptRound] );
+                if( ++cryptRound < SPECK_ROUNDS ) return;
+                uint8_t* ks = &cryptKs[cryptChunk*8];
+                for( uint8_t i = 0; i < 8; i++ ) ks[i] = ((uint8_t*)cryptS)[i];
+                cryptRound = 0;
+                cryptChunk++;
+                cryptCtr++;
+                cryptLoad();
+                }
+
+                //uread, making the keystream while there is nothing to read- a round
+                //is never started with a byte waiting, so the rx fifo (2 bytes) only
+                //needs one round plus the per byte work to fit in 2 byte times
+                static uint8_t
+ureadCrypt      ()
+                {
+                #if UART_CTS || UART_XONXOFF
+                if( rxIdx < rxCount ) return uread();
+                #endif
+                while( (Uart->STATUS & 0x80) == 0 ) cryptStep(); //RXC
+                return Uart->RXDATAL;
+                }
+
+                static void //decrypt xmodemData (finish the keystream first if needed)
+cryptData       ()
+                {
+                while( cryptChunk < X_DATA_SIZE/8 ) cryptStep();
+                for( uint8_t i = 0; i < X_DATA_SIZE; i++ ) xmodemData[i] ^= cryptKs[i];
+                }
+                #endif
+
                 static bool
 xmodem          () //we let caller ack when its ready for more data
                 {
@@ -297,57 +1168,593 @@ xmodem          () //we let caller ack when its ready for more data
                     uint16_t crc = 0;
                     c = uread();
                     if( c == X_EOT ) return false;
-                    if( c != X_SOH ) continue;
+                    bool fec = false, addr = false;
+                    #if X_FEC
+                    fec = (c == X_SOHF);
+                    uint16_t fa[FEC_WAYS] = {0}, fb[FEC_WAYS] = {0};
+                    #endif
+                    #if X_ADDR
+                    addr = (c == X_SOHA);
+                    #endif
+                    if( c != X_SOH && ! fec && ! addr ){ command( c ); continue; }
                     //X_SOH seen
-                    uint8_t blockSum = uread() + uread(); //block#,block#inv, sum should be 255
+                    uint8_t blk = uread();
+                    uint8_t blockSum = blk + uread(); //block#,block#inv, sum should be 255
+                    #if X_ADDR
+                    uint16_t offset = 0;
+                    if( addr ){ //offset is included in the crc
+                        uint8_t lo = uread(), hi = uread();
+                        crc = crc16( crc16(crc, lo), hi );
+                        offset = lo | (hi<<8);
+                        }
+                    #endif
+                    #if BL_CRYPT && X_ADDR
+                    cryptStart( addr ? offset : cryptNext );
+                    #elif BL_CRYPT
+                    cryptStart( cryptNext );
+                    #endif
                     for( uint8_t i = 0; i < X_DATA_SIZE; i++ ){
+                        #if BL_CRYPT
+                        uint8_t v = ureadCrypt(); //keystream made while the data arrives
+                        #else
                         uint8_t v = uread();
+                        #endif
                         xmodemData[i] = v;
                         crc = crc16( crc, v );
+                        #if X_FEC
+                        uint8_t w = i % FEC_WAYS;
+                        fa[w] = fecAdd( fa[w], v );
+                        fb[w] = fecAdd( fb[w], fa[w] );
+                        #endif
                         }
-                    if( crc == ((uread()<<8u) + uread()) && blockSum == 255 ) break;
-                    uwrite( X_NACK ); //bad checksum or block# pair not a match
+                    uint16_t crcRx = uread()<<8;
+                    crcRx |= uread();
+                    #if X_FEC
+                    bool fixed = fec;
+                    if( fec ){ //always read the check bytes so we stay in sync with the sender
+                        for( uint8_t w = 0; w < FEC_WAYS; w++ ){
+                            uint16_t a = uread()<<8; a |= uread();
+                            uint16_t b = uread()<<8; b |= uread();
+                            if( a > 256 || b > 256 ){ fixed = false; continue; }
+                            if( fixed ) fixed = fecFix( fecAdd(a, 257-fa[w]), fecAdd(b, 257-fb[w]), w );
+                            }
+                        }
+                    #endif
+                    if( blockSum != 255 ){ xnack(); continue; } //block# pair not a match
+                    xmodemBlock = blk;
+                    xmodemType = c;
+                    #if X_ADDR
+                    xmodemAddr = offset;
+                    #endif
+                    if( crc == crcRx ) break;
+                    #if X_FEC
+                    if( fixed ){ //corrected in place, check again
+                        crc = 0;
+                        for( uint8_t i = 0; i < X_DATA_SIZE; i++ ) crc = crc16( crc, xmodemData[i] );
+                        if( crc == crcRx ) break;
+                        }
+                    #endif
+                    xnack(); //bad checksum (and not correctable)
                     }
                 return true;
                 }
 
+                #if BL_HANDOFF || BL_LOG
+                static void //session start, time it with the rtc (internal 32k, div32 = 1024Hz)
+sessionStart    ()
+                {
+                sessBlocks = sessNacks = 0;
+                RTC.CLKSEL = 0; //INT32K
+                while( RTC.STATUS ){} //sync busy
+                RTC.CNT = 0; //each session from 0 (X_END stay runs another)
+                RTC.INTFLAGS = 1; //OVF
+                while( RTC.STATUS ){}
+                RTC.CTRLA = (5<<3) | 1; //PRESCALER=DIV32, RTCEN
+                }
+
                 static void
+sessionEnd      ()
+                {
+                while( RTC.STATUS ){}
+                sessTicks = (RTC.INTFLAGS & 1) ? 0xFFFF : RTC.CNT; //OVF = 64s or more
+                RTC.CTRLA = 0; //not left running for the app
+                }
+                #endif
+
+                #if BL_LOG
+                enum { LOG_OK, LOG_FAILED, LOG_STARTED = 0x0F }; //outcome
+                uint8_t
+logSlot, logSeq ; //entry used by this session, its sequence number
+                bool
+logOpen         ; //entry written as LOG_STARTED, waiting for the outcome
+
+                static void //seq, outcome|baudStep<<4, blocks, nacks, ticks (16bit little endian)
+logWrite        (uint8_t outcome)
+                {
+                volatile uint8_t* e = (volatile uint8_t*)BL_LOG_EE + logSlot*BL_LOG_SIZE;
+                uint8_t v[BL_LOG_SIZE] = {
+                    logSeq, outcome | (baudStep<<4),
+                    sessBlocks, sessBlocks>>8, sessNacks, sessNacks>>8, sessTicks, sessTicks>>8
+                    };
+                while( NVMCTRL.STATUS & 2 ){} //ee is busy
+                for( uint8_t i = 0; i < BL_LOG_SIZE; i++ ) e[i] = v[i]; //page buffer, 1 write
+                nvmWrite(); //not waiting, nvmCmd waits before the next nvm command
+                }
+
+                //next slot is after the newest entry- the first one not followed by seq+1
+                //an entry left as LOG_STARTED is a session that never ended (reset, power)
+                static void
+logStart        ()
+                {
+                if( logOpen ) return;
+                logOpen = true;
+                volatile uint8_t* ee = (volatile uint8_t*)BL_LOG_EE;
+                uint8_t i = 0;
+                while( i < BL_LOG_ENTRIES-1 && ee[(i+1)*BL_LOG_SIZE] == (uint8_t)(ee[i*BL_LOG_SIZE]+1) ) i++;
+                logSlot = (i+1) % BL_LOG_ENTRIES;
+                logSeq = ee[i*BL_LOG_SIZE] + 1;
+                logWrite( LOG_STARTED );
+                }
+
+                static void //outcome for the entry, if the session got that far
+logEnd          (uint8_t outcome)
+                {
+                if( ! logOpen ) return;
+                logOpen = false;
+                logWrite( outcome );
+                }
+                #endif
+
+                #if BL_HANDOFF
+                static void //check byte, all bytes add up to 0xFF
+handoffSeal     ()
+                {
+                blHandoff->check = 0;
+                blHandoff->check = 0xFF - blHandoffSum();
+                }
+
+                static void //at reset, before anything else
+handoffBoot     ()
+                {
+                if( ! blHandoffOk() ){ //power on (or app overwrote it), start over
+                    for( uint8_t i = 0; i < sizeof(bl_handoff_t); i++ ) ((volatile uint8_t*)blHandoff)[i] = 0;
+                    blHandoff->magic = BL_HANDOFF_MAGIC;
+                    }
+                blHandoff->resetFlags = resetFlags;
+                blHandoff->blVersion = BL_VERSION;
+                uint8_t f = blHandoff->flags;
+                //a session right before this reset is reported for this boot only
+                if( f & BL_HO_PENDING ) f = BL_HO_SESSION | ((f & BL_HO_FAILED) ? BL_HO_FAILED : BL_HO_UPDATED);
+                else f = 0;
+                blHandoff->flags = f;
+                handoffSeal();
+                }
+
+                static void //session end, ok = app programmed
+handoffEnd      (bool ok)
+                {
+                blHandoff->ticks = sessTicks;
+                blHandoff->blocks = sessBlocks;
+                blHandoff->baudStep = baudStep;
+                blHandoff->flags = BL_HO_PENDING | (ok ? 0 : BL_HO_FAILED);
+                if( ok ) blHandoff->updates++; else blHandoff->fails++;
+                handoffSeal();
+                }
+                #endif
+
+                #if X_YMODEM
+                uint16_t
+imageLen        ; //from the header, 0 = no header (write all data)
+                uint16_t
+imageCrc        ;
+                bool
+imageHasCrc     ;
+                #if BL_AUTH
+                uint32_t
+imageMac        [2]; //from the header
+                #endif
+                #if BL_CRYPT
+                enum { Y_FIELDS = 5 }; //'#' crc mac0 mac1 nonce0 nonce1
+                #elif BL_AUTH
+                enum { Y_FIELDS = 3 }; //'#' crc mac0 mac1
+                #else
+                enum { Y_FIELDS = 1 }; //'#' crc
+                #endif
+
+                //space separated decimal fields from xmodemData[*i] to the NUL (*i is
+                //left there), the first max are kept in v (zeroed), returns the count
+                static uint8_t
+yFields         (uint8_t* i, uint32_t* v, uint8_t max)
+                {
+                uint8_t n = 0;
+                bool num = false; //in a field
+                for( ; *i < X_DATA_SIZE && xmodemData[*i]; ++*i ){
+                    uint8_t c = xmodemData[*i];
+                    bool digit = c >= '0' && c <= '9';
+                    if( digit ){ if( n < max ) v[n] = v[n]*10 + c - '0'; }
+                    else if( num ) n++;
+                    num = digit;
+                    }
+                if( num ) n++; //last field ended by NUL
+                return n < max ? n : max;
+                }
+
+                //block 0 in xmodemData- name NUL length [modtime mode serial ...] NUL
+                //['#' crc [mac0 mac1 [nonce0 nonce1]]]
+                static bool
+yHeader         ()
+                {
+                uint8_t i = 0;
+                while( xmodemData[i] ) if( ++i == X_DATA_SIZE ) return false; //skip name
+                if( i == 0 ) return false; //null header, no file
+                i++;
+                uint32_t len = 0; //the rest of the standard fields are not used
+                if( yFields(&i, &len, 1) == 0 || len == 0 || len > APP_MAX ) return false;
+                //our fields are after the NUL ending the standard ones (zeros from
+                //a plain ymodem sender, so its files remaining is never a crc)
+                uint32_t v[Y_FIELDS] = {0};
+                uint8_t n = 0;
+                if( i < X_DATA_SIZE-1 && xmodemData[i+1] == '#' ){ i += 2; n = yFields( &i, v, Y_FIELDS ); }
+                #if BL_AUTH
+                if( n < 3 ) return false; //no mac
+                imageMac[0] = v[1];
+                imageMac[1] = v[2];
+                #endif
+                #if BL_CRYPT
+                if( n < 5 ) return false; //no nonce
+                cryptNonce[0] = v[3];
+                cryptNonce[1] = v[4];
+                #endif
+                imageLen = len;
+                imageCrc = v[0];
+                imageHasCrc = n >= 1;
+                return true;
+                }
+                #endif
+
+                #if BL_AUTH
+                static const uint32_t
+authKey         [4] = { BL_AUTH_KEY }; //k0 l0 l1 l2
+                uint32_t
+authRk          [SPECK_ROUNDS]; //round keys
+                uint32_t
+authMac         [2]; //mac state, s[0] s[1] (y x in speck terms)
+
+                static void
+authStart       (uint16_t len)
+                {
+                speckKey( authKey, authRk );
+                authMac[0] = len;
+                authMac[1] = 0;
+                speckEnc( authMac, authRk );
+                }
+
+                static void //n bytes, 8 at a time into the state (little endian)
+authData        (const uint8_t* p, uint8_t n)
+                {
+                for( uint8_t i = 0; i < n; i++ ){
+                    ((uint8_t*)authMac)[i % 8] ^= p[i];
+                    if( i % 8 == 7 || i == n-1 ) speckEnc( authMac, authRk );
+                    }
+                }
+                #endif
+
+                static bool //return true if app is ok to mark as programmed
 programApp      ()
                 {
+                flowOn(); //host can send
                 Xbroadcast(); //let other end know we are here
+                #if BL_HANDOFF || BL_LOG
+                sessionStart(); //host is there, time the session
+                #endif
                 ledOn(); //on when xmodem active (probably will not see for very long)
                 volatile uint8_t* flashPtr = appMemStart;
+                uint8_t pageCmd = NVM_ERWP;
+                lastBlock = 0;
+                #if UART_CTS || UART_XONXOFF
+                xnacked = false;
+                #endif
+                //nothing carried over from a previous session (X_END stay)
+                #if X_YMODEM
+                imageLen = 0;
+                imageHasCrc = false;
+                #endif
+                #if BL_CRYPT
+                cryptNext = 0;
+                #endif
+                #if BAUD_ADAPT
+                ackStreak = nackStreak = 0;
+                #endif
+                #if BL_AUTH
+                //only this session's header and data count- an EOT alone would
+                //otherwise compare two zero macs and mark what is in flash ok
+                bool authHeader = false, authWrote = false;
+                authMac[0] = authMac[1] = imageMac[0] = imageMac[1] = 0;
+                #endif
                 while( xmodem() ){ //returns false when EOT seen
+                    #if BL_LOG
+                    logStart(); //first packet, in case the session never ends
+                    #endif
+                    uint8_t n = X_DATA_SIZE; //bytes to write
+                    #if X_YMODEM
+                    if( xmodemBlock == 0 && xmodemType != X_SOHA && flashPtr == appMemStart && imageLen == 0 ){
+                        if( yHeader() == false ){ uwrite( X_CAN ); uwrite( X_CAN ); return false; }
+                        #if BL_AUTH
+                        authStart( imageLen );
+                        authHeader = true;
+                        #endif
+                        #if BL_CRYPT
+                        speckKey( cryptKey, cryptRk ); //for the data packets to follow
+                        #endif
+                        flowOff(); //before any nvm wait
+                        if( *eeLastBytePtr != 0xFF ) eeWrite( eeLastBytePtr, 0xFF ); //app not valid until done
+                        //erase only what is needed, then data only needs a page write
+                        for( uint16_t e = 0; e < imageLen; e += MAPPED_PROGMEM_PAGE_SIZE ){
+                            appMemStart[e] = 0xFF; //page buffer write sets the page address
+                            nvmCmd( NVM_ER );
+                            wdtKick();
+                            }
+                        flowOn();
+                        pageCmd = NVM_WP;
+                        xack();
+                        uwrite( X_PING ); //ymodem- ready for data
+                        continue;
+                        }
+                    #endif
+                    #if BL_AUTH || BL_CRYPT
+                    if( imageLen == 0 ){ uwrite( X_CAN ); uwrite( X_CAN ); return false; } //no header, no mac/nonce
+                    #endif
+                    if( xmodemBlock == lastBlock ){ xack(); continue; } //already written
+                    #if UART_CTS || UART_XONXOFF
+                    //streaming- behind is already written (ack again), ahead is
+                    //dropped until the host goes back to the block we want
+                    if( xmodemBlock != (uint8_t)(lastBlock+1) ){
+                        if( (uint8_t)(xmodemBlock - lastBlock) >= 128 ) xack();
+                        else xnack(); //a block was lost
+                        continue;
+                        }
+                    #else
+                    //anything else out of sequence would be written at the wrong
+                    //address (flashPtr only moves on an ack), so give up
+                    if( xmodemBlock != (uint8_t)(lastBlock+1) ){ uwrite( X_CAN ); uwrite( X_CAN ); return false; }
+                    #endif
+                    #if X_ADDR
+                    if( xmodemType == X_SOHA ){
+                        if( xmodemAddr % X_DATA_SIZE ){ uwrite( X_CAN ); uwrite( X_CAN ); return false; }
+                        flashPtr = appMemStart + xmodemAddr;
+                        }
+                    #endif
+                    //no room (would write the staging area, or past the end of flash)
+                    if( (uint16_t)(flashPtr - appMemStart) >= APP_MAX ){ uwrite( X_CAN ); uwrite( X_CAN ); return false; }
+                    #if X_YMODEM
+                    if( imageLen ){ //do not write past the image length
+                        uint16_t done = flashPtr - appMemStart;
+                        uint16_t left = done < imageLen ? imageLen - done : 0;
+                        if( left < n ) n = left;
+                        }
+                    #endif
+                    //cpu is halted during a flash write and the usart rx buffer is only
+                    //2 bytes, so have host pause while we write (if flow control enabled)
+                    #if BL_CRYPT
+                    cryptData(); //crc was checked on the encrypted data, now decrypt
+                    #endif
+                    flowOff(); //before any nvm wait
+                    if( *eeLastBytePtr != 0xFF ) eeWrite( eeLastBytePtr, 0xFF ); //app not valid until done
+                    while( NVMCTRL.STATUS & 3 ){} //page buffer free (BL_LOG eeprom write)
                     uint8_t i = 0;
                     uint8_t pbc = 0; //page buffer count
                     //also handle avr0/1 with page size < 128 (64 is the only other lower value)
-                    while( i < X_DATA_SIZE ){ //128
+                    while( i < n ){ //128, or less if last block of a ymodem image
                         flashPtr[i] = xmodemData[i]; //write to page buffer
                         i++;
-                        if( ++pbc < MAPPED_PROGMEM_PAGE_SIZE ) continue;
-                        nvmWrite(); //end of page, write page buffer
+                        if( ++pbc < MAPPED_PROGMEM_PAGE_SIZE && i < n ) continue;
+                        nvmCmd( pageCmd ); //end of page (or data), write page buffer
                         pbc = 0; //reset page buffer count
                         }
+                    flowOn(); //writes done, host can resume
                     i = 0;
-                    while( (flashPtr[i] == xmodemData[i]) && (++i < X_DATA_SIZE) ){} //verify
-                    if( i != X_DATA_SIZE ){ uwrite( X_NACK ); continue; }
-                    uwrite( X_ACK ); //ok
+                    while( i < n && flashPtr[i] == xmodemData[i] ) i++; //verify
+                    //failed, so page may no longer be erased- erase/write from now on
+                    if( i != n ){ pageCmd = NVM_ERWP; xnack(); continue; }
+                    #if BL_AUTH
+                    #if X_ADDR
+                    if( xmodemType == X_SOHA ){ authMac[0] ^= xmodemAddr; speckEnc( authMac, authRk ); }
+                    #endif
+                    authData( xmodemData, n );
+                    authWrote = true;
+                    #endif
+                    lastBlock = xmodemBlock;
+                    #if UART_CTS || UART_XONXOFF
+                    xnacked = false;
+                    #endif
+                    #if BL_HANDOFF || BL_LOG
+                    sessBlocks++;
+                    #endif
+                    xack(); //ok
                     flashPtr += X_DATA_SIZE; //next page
+                    #if BL_CRYPT
+                    cryptNext = flashPtr - appMemStart;
+                    #endif
                     //if flash write failure- instead of retrying flash write on our own (we already have the data),
                     //let the sender know there is an error so it is informed
                     //(it will send the data again, the sender will decide when/whether its time to give up)
                     }
+                #if BL_LOG
+                logStart(); //EOT with no data is still a session
+                #endif
                 uwrite( X_ACK ); //ack the EOT
+                #if UART_CTS || UART_XONXOFF
+                uwriteEsc( lastBlock+1 ); //streaming- tells it from acks to blocks sent again
+                #endif
+                #if X_YMODEM
+                if( imageLen ){
+                    uwrite( X_PING ); //ymodem- next file, sender ends the batch with a null header
+                    if( xmodem() ) xack();
+                    if( imageHasCrc ){ //verify the whole image
+                        uint16_t crc = 0;
+                        for( uint16_t i = 0; i < imageLen; i++ ) crc = crc16( crc, appMemStart[i] );
+                        if( crc != imageCrc ) return false;
+                        }
+                    }
+                #endif
+                #if BL_AUTH
+                if( ! authHeader || ! authWrote ) return false; //nothing was checked
+                if( authMac[0] != imageMac[0] || authMac[1] != imageMac[1] ) return false;
+                #endif
+                return true;
+                }
+
+                static void //!0xFF in last eeprom byte signifies to bootloader that flash is programmed
+eeAppOK         () { eeWrite( eeLastBytePtr, 0 ); }
+
+                #if BL_CRCSCAN
+                static void //reference crc for the CRCSCAN peripheral, in the last 2 bytes of flash
+crcScanStore    ()
+                {
+                volatile uint8_t* flash = (volatile uint8_t*)MAPPED_PROGMEM_START;
+                uint16_t crc = CRCSCAN_INIT;
+                for( uint16_t i = 0; i < MAPPED_PROGMEM_SIZE-2; i++ ) crc = crc16( crc, flash[i] );
+                volatile uint8_t* last = flash + MAPPED_PROGMEM_SIZE - MAPPED_PROGMEM_PAGE_SIZE;
+                for( uint8_t i = 0; i < MAPPED_PROGMEM_PAGE_SIZE-2; i++ ) xmodemData[i] = last[i];
+                xmodemData[MAPPED_PROGMEM_PAGE_SIZE-2] = crc>>8;
+                xmodemData[MAPPED_PROGMEM_PAGE_SIZE-1] = crc;
+                nvmPage( last, xmodemData );
+                }
+
+                static void //scan runs while the app does, app checks the result
+crcScanStart    ()
+                {
+                CRCSCAN.CTRLB = 0x20; //MODE=BACKGROUND, SRC=FLASH
+                CRCSCAN.CTRLA = 1; //ENABLE
+                }
+                #endif
+
+                #if BL_STAGE
+                static void //copy an image the app staged in upper flash into place
+stageCopy       ()
+                {
+                volatile uint8_t* ee = (volatile uint8_t*)BL_STAGE_EE;
+                if( ee[0] != BL_STAGE_MAGIC ) return;
+                uint16_t len = ee[1] | (ee[2]<<8);
+                uint16_t crc = (ee[3]<<8) | ee[4];
+                const uint8_t* src = (const uint8_t*)(MAPPED_PROGMEM_START + BL_STAGE_START);
+                //no bigger than the app area it goes to, or the staging area it is in
+                uint16_t max = BL_STAGE_START - BL_SIZE;
+                if( max > MAPPED_PROGMEM_SIZE - BL_STAGE_START ) max = MAPPED_PROGMEM_SIZE - BL_STAGE_START;
+                //check the staged image first, if bad the app in place is left as is
+                bool ok = len && len <= max;
+                uint16_t i;
+                if( ok ){
+                    uint16_t c = 0;
+                    for( i = 0; i < len; i++ ) c = crc16( c, src[i] );
+                    ok = c == crc;
+                    }
+                if( ok ){
+                    //marker is only cleared when done, so a power loss here
+                    //will just do the copy again on the next boot
+                    for( i = 0; i < len; i += MAPPED_PROGMEM_PAGE_SIZE ) nvmPage( appMemStart+i, src+i );
+                    for( i = 0; i < len && appMemStart[i] == src[i]; i++ ){} //verify
+                    eeWrite( eeLastBytePtr, i == len ? 0 : 0xFF ); //app programmed, or not
+                    #if BL_HANDOFF
+                    if( i == len ){ blHandoff->flags = BL_HO_UPDATED; blHandoff->updates++; handoffSeal(); }
+                    #endif
+                    }
+                eeWrite( ee, 0xFF ); //clear marker
+                }
+                #endif
+
+                #if BL_SERVICES
+                //these are called by the app, so cannot use any bootloader ram
+                //(the app owns it), and need to stay out of line
+
+                static uint8_t
+svcRead         ()
+                {
+                while ( (Uart->STATUS & 0x80) == 0 ){} //RXC
+                return Uart->RXDATAL;
+                }
+
+                __attribute(( section(".blservices"), used )) static const bl_services_t
+services        = {
+                BL_SERVICES_MAGIC,
+                BL_SERVICES_VERSION,
+                crc16,
+                nvmCmd,
+                nvmPage,
+                svcRead,
+                uwrite,
+                BL_VERSION
+                };
+                #endif
+
+                #if X_END
+                static void //put back what we changed, then run the app (no reset)
+appRun          ()
+                {
+                utxDone(); //ack is out
+                Uart->CTRLB = 0;
+                UartTx.port->DIRCLR = UartTx.pinbm;
+                (&UartRx.port->PIN0CTRL)[UartRx.pin] = 0;
+                (&Sw.port->PIN0CTRL)[Sw.pin] = 0;
+                Led.port->DIRCLR = Led.pinbm;
+                Led.port->OUTCLR = Led.pinbm;
+                #if UART_CTS
+                UartCts.port->DIRCLR = UartCts.pinbm;
+                UartCts.port->OUTCLR = UartCts.pinbm;
+                #endif
+                CCP = 0xD8; CLKCTRL.MCLKCTRLB = 0x11; //reset value, div6
+                #if BL_HANDOFF || BL_LOG
+                //session timer, still running if the 'G' came before sessionEnd
+                while( RTC.STATUS ){} //sync busy
+                RTC.CTRLA = 0;
+                while( RTC.STATUS ){}
+                RTC.CNT = 0; //reset values
+                RTC.CLKSEL = 0;
+                RTC.INTFLAGS = 1; //OVF
+                #endif
+                #if BL_WDT
+                while( WDT.STATUS & 1 ){} //SYNCBUSY
+                CCP = 0xD8; WDT.CTRLA = 0;
+                #endif
+                #if BL_HANDOFF
+                handoffBoot();          //as if reset- session result now shows
+                #endif
+                #if BL_CRCSCAN
+                crcScanStart();
+                #endif
+                goto *appStartAddr;
                 }
 
+                //X_CMD_GO- ack and run the app, or nack if there is no app (or a partial one)
                 static void
-eeAppOK         ()
+appGo           ()
                 {
-                *eeLastBytePtr = 0; //write to eeprom page buffer, last eeprom byte
-                nvmWrite(); //write eeprom (!0xFF signifies to bootloader that flash is programmed)
-                while( NVMCTRL.STATUS & 2 ){} //ee is busy
+                uint8_t ok = *eeLastBytePtr; //an update request (not 0 or 0xFF) still has the app
+                if( ok == 0xFF || *appMemStart == 0xFF ){ uwrite( X_NACK ); return; }
+                if( ok ) eeWrite( eeLastBytePtr, 0 ); //drop the request
+                uwrite( X_ACK );
+                appRun();
                 }
 
+                //wait for a session end command, returns X_CMD_STAY, or 0 = none
+                static uint8_t
+endCommand      ()
+                {
+                uwrite( X_PING ); //ready, the host waits for this before a command
+                while(1){
+                    int16_t c = ureadTimeout( F_CPU/10/10 ); //about 100ms
+                    if( c < 0 ) return 0;
+                    if( c != X_CMD_GO && c != X_CMD_STAY && c != X_CMD_DUMP ) continue;
+                    if( (uint8_t)(ureadTimeout(F_CPU/10/10) + c) != 255 ) continue; //needs ~cmd
+                    wdtKick();
+                    if( c == X_CMD_STAY ){ uwrite( X_ACK ); return c; }
+                    if( c == X_CMD_GO ){ appGo(); continue; } //returns only if no app
+                    int16_t mask = ureadTimeout( F_CPU/10/10 );
+                    if( mask >= 0 ) dumpSelect( mask );
+                    }
+                }
+                #endif
+
                 int
 main            (void)
                 {
@@ -355,12 +1762,49 @@ main            (void)
                 //check if bootloader needs to run, true=run, false=jump to app
                 //convert BL_SIZE to flash address mapped into data space
                 //goto will result in a jmp instruction so can use byte address
-                if( entryCheck() == false ) goto *appStartAddr;
+                resetFlags = RSTCTRL.RSTFR;
+                #if BL_WDT || BL_HANDOFF
+                RSTCTRL.RSTFR = resetFlags; //clear, so next time only the new cause is seen
+                #endif
+                #if BL_HANDOFF
+                handoffBoot();          //reset flags, last session result
+                #endif
+                #if BL_STAGE
+                stageCopy();            //app staged an update, copy into place
+                #endif
+                if( entryCheck() == false ){
+                    #if BL_CRCSCAN
+                    crcScanStart();     //check flash in the background
+                    #endif
+                    goto *appStartAddr;
+                    }
 
                 //we are now officially a bootloader
                 init();
-                programApp();
-                eeAppOK();              //mark that app is programmed
+                while(1){
+                    bool ok = programApp();
+                    flowOff();          //nvm writes below, the host may already send a command
+                    if( ok ){
+                        #if BL_CRCSCAN
+                        crcScanStore(); //crc for the background check, before app is marked ok
+                        #endif
+                        eeAppOK();      //mark that app is programmed
+                        }
+                    #if BL_HANDOFF || BL_LOG
+                    sessionEnd();
+                    #endif
+                    #if BL_LOG
+                    logEnd( ok ? LOG_OK : LOG_FAILED );
+                    #endif
+                    #if BL_HANDOFF
+                    handoffEnd( ok );   //app sees it after the reset
+                    #endif
+                    flowOn();
+                    #if X_END
+                    if( endCommand() == X_CMD_STAY ) continue; //host wants another session
+                    #endif
+                    break;
+                    }
                 dumpSigrow();           //dump sigrow, fuses, flash, eeprom
                 dumpFuses();            //can use to verify flash or check
                 dumpFlash();            //other things- device id, fuses, etc.
@@ -11,26 +11,31 @@
     $ stty -F /dev/ttyACM1 230400
     $ sx my_project_bin < /dev/ttyACM1 > /dev/ttyACM1
 
-    this example also allows using the pc to reset the mcu via the rx pin
-    if any falling edge seen on the rx pin or the sw pin, the port irq will
-    fire and either software reset (sw) or first erase the last byte in 
-    eeprom (rx)
+    this example also allows using the pc to reset the mcu via the usart
+    a falling edge on the sw pin fires the port irq and does a software reset,
+    the usart rx irq looks for the update request- the bytes in updateMagic
+    in a row, or a break (rx held low) of at least BREAK_MS- and then first
+    sets the last byte in eeprom to an update request and does a software reset
+    any other data on the rx line (or a glitch) is ignored, so the serial
+    line can be shared with normal traffic without causing a reboot
 
     if the sw pin is triggered, it will remain pressed long enough for the 
     bootloader to see, and will remain in the bootloader
 
-    if the rx pin is triggered (via pc), we wil need to erase the last byte in 
-    eeprom so the bootloader does not jump to the app
+    if the update request is seen (via pc), we wil need to set the last byte in 
+    eeprom so the bootloader does not jump to the app (a value other than 0xFF
+    tells a BL_WDT bootloader this app is still good to run if no update comes)
     this method will require the bootloader to load an app (or simply have the
     xmodem send a null file so an EOT is seen by the mcu) as the eeprom byte 
     will need to be set before the bootloader will jump to an app again, where 
     the sw pin method does not require programming (just power up again without 
     sw pressed)
 
-    Linux command line (first trigger rx pin by sending 0xFF)-
+    Linux command line (first send the update request)-
     $ stty -F /dev/ttyACM1 230400
-    $ printf "\xFF" > /dev/ttyACM1
+    $ printf "\xA5BOOT\x5A" > /dev/ttyACM1
     $ sx my_project_bin < /dev/ttyACM1 > /dev/ttyACM1
+    (or send a break- python3 -c "import serial; serial.Serial('/dev/ttyACM1').send_break(0.1)")
 
     the mcu will dump out sigrow, fuse, flash, eeprom data after programming
     and you can do whatever you wish with this data
@@ -50,6 +55,9 @@
 #define F_CPU 3333333ul
 #include <util/delay.h>
 
+#define UART_BAUD   230400      // same as the bootloader
+#define BREAK_MS    20          // rx low this long is an update request
+
                 //pins type
                 typedef struct {
                     PORT_t* port;
@@ -60,17 +68,23 @@
 pin_t           ;
 
                 //our pins- Led and Sw
-                //Sw and UartRx falling edge will trigger a reset
+                //Sw falling edge or a usart update request will trigger a reset
                 static const pin_t
 Led             = { &PORTA, 3, 1<<3, 0 };
                 static const pin_t
 Sw              = { &PORTB, 7, 1<<7, 0 };
+                static USART_t* const
+Uart            = &USART0;
                 static const pin_t
 UartRx          = { &PORTB, 3, 1<<3, 0 };
 
                 static volatile uint8_t* const
 eeLastBytePtr   = (volatile uint8_t*)EEPROM_END;
 
+                //update request, sent by the pc at UART_BAUD
+                static const uint8_t
+updateMagic     [] = { 0xA5, 'B', 'O', 'O', 'T', 0x5A };
+
 
                 static void
 softReset       () { CCP = 0xD8; RSTCTRL.SWRR = 1; } //software reset
@@ -79,7 +93,11 @@ softReset       () { CCP = 0xD8; RSTCTRL.SWRR = 1; } //software reset
 init            ()
                 {
                 (&Sw.port->PIN0CTRL)[Sw.pin] = 0x08 | 0x03; //pullup on, falling edge sense        
-                (&UartRx.port->PIN0CTRL)[UartRx.pin] = 0x08 | 0x03; //pullup on, falling edge sense
+                (&UartRx.port->PIN0CTRL)[UartRx.pin] = 0x08; //pullup on
+                //3.33MHz is too slow for normal mode at 230400 (BAUD < 64), so use CLK2X
+                Uart->BAUD = (F_CPU*8 + UART_BAUD/2)/UART_BAUD;
+                Uart->CTRLA = 0x80; //RXCIE
+                Uart->CTRLB = 0x80 | 0x02; //RXEN, RXMODE=CLK2X
                 asm("sei");
                 }
 
@@ -88,26 +106,49 @@ nvmWrite        () { CCP = 0x9D; NVMCTRL.CTRLA = 3; } //ERWP
 
 
                 static void
-eeAppOK         ()
+eeUpdateRequest ()
                 {
-                *eeLastBytePtr = 0xFF; //write to eeprom page buffer, last eeprom byte
-                nvmWrite(); //write eeprom (0xFF signifies to bootloader that flash is unprogrammed)
+                *eeLastBytePtr = 0x01; //write to eeprom page buffer, last eeprom byte
+                nvmWrite(); //write eeprom (not 0 or 0xFF- update requested, this app still intact)
                 while( NVMCTRL.STATUS & 2 ){} //ee is busy
                 }
 
-                //both pin irq's are on same port, so only PORTB isr
+                //sw pin irq
                 __attribute(( signal, used )) void 
 PORTB_PORT_vect()
                 {
-                uint8_t flags = PORTB.INTFLAGS; //both Sw and UartRx flags
+                uint8_t flags = PORTB.INTFLAGS;
                 PORTB.INTFLAGS = flags; //clear in case not our pin
-                if( 0 == (flags & (Sw.pinbm|UartRx.pinbm)) ) return; //not our pins
-                //if sw pin, then just reset- bootloader will also see pin pressed and remain in bootloader
-                //if UartRx pin, then need to erase last eeprom byte so bootloader does not jump to this app again
-                if( flags & UartRx.pinbm ) eeAppOK();
+                if( 0 == (flags & Sw.pinbm) ) return; //not our pin
+                //just reset- bootloader will also see pin pressed and remain in bootloader
                 softReset();
                 }
 
+                //update request- need to set last eeprom byte so bootloader does not jump to this app again
+                static void
+updateRequest   () { eeUpdateRequest(); softReset(); }
+
+                //usart rx irq, look for the update request
+                __attribute(( signal, used )) void
+USART0_RXC_vect ()
+                {
+                static uint8_t idx; //updateMagic bytes matched so far
+                uint8_t status = Uart->RXDATAH; //read before RXDATAL
+                uint8_t c = Uart->RXDATAL;
+                if( (status & 0x04) && c == 0 ){ //FERR with 0 data, start of a break
+                    //only one byte is received for a break, so time it by the pin
+                    for( uint8_t ms = 0; (UartRx.port->IN & UartRx.pinbm) == 0; ms++ ){
+                        if( ms >= BREAK_MS ) updateRequest();
+                        _delay_ms( 1 );
+                        }
+                    idx = 0;
+                    return;
+                    }
+                if( c != updateMagic[idx] ) idx = 0; //no match, may be the start of a new one
+                if( c == updateMagic[idx] ) idx++;
+                if( idx == sizeof(updateMagic) ) updateRequest();
+                }
+
                 static void
 ledTog          () { Led.port->DIRSET = Led.pinbm; Led.port->OUTTGL = Led.pinbm; }
 
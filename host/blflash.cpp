@@ -0,0 +1,399 @@
+/*-----------------------------------------------------------------------------
+    blflash- upload an app to the bootloader (in place of sx)
+
+    build-
+    $ g++ -std=c++17 -O2 -o blflash blflash.cpp
+
+    use-
+    $ blflash /dev/ttyACM1 my_project.bin|.hex|.elf [options]
+        -b baud     UART_BAUD the bootloader was compiled with (230400)
+        -r          rts/cts flow control (UART_CTS)
+        -x          xon/xoff flow control (UART_XONXOFF)
+        -w n        data blocks sent ahead with -r/-x (8), 1 = wait for each
+                    ack
+        -f          send X_SOHF packets (X_FEC)
+        -a down up  adaptive baud, same values as the bootloader
+                    BAUD_NACK_DOWN, BAUD_ACK_UP (BAUD_ADAPT)
+        -s step     start at baud step (X_CMD_BAUD, needs X_PROBE)
+        -y          send a ymodem header with the image length and crc
+                    (X_YMODEM), no SUB padding is then written to flash
+        -k key      image mac key (BL_AUTH), the 4 BL_AUTH_KEY words in hex
+                    separated by commas, like -k 03020100,0B0A0908,13121110,1B1A1918
+                    (implies -y, the mac is sent in the header)
+        -e key      encrypt the data packets (BL_CRYPT), BL_CRYPT_KEY words
+                    as for -k (implies -y, a random nonce is sent in the header)
+        -L          print the session log first (X_CMD_LOG, needs BL_LOG)
+        -l size     BL_SIZE, the app start for hex/elf addresses (2048)
+        -d file     save the dump data the bootloader sends when done
+        -g          run the app when done, no dumps or reset (X_END)
+        -D mask     dumps to read when done, then run the app (X_END)-
+                    1 = sigrow, 2 = fuses, 4 = flash, 8 = eeprom
+        -T ms       wait for the X_END ready ping after the upload, while
+                    the bootloader checks the image (5000)
+        -t ms       data block ack wait (default- 1s for the first 8 blocks,
+                    then 4x the slowest round trip seen, at least 100ms)
+        -n          leave the port latency settings alone
+        -m file     append a json line of session metrics to file
+        -p file     keep prometheus text format metrics in file (for the
+                    node_exporter textfile collector)
+        -q          skip the upload if the app is already this image (X_QUERY),
+                    with -g or -D the dumps are read and the app is run (X_END)
+
+    usb serial bridges add a usb frame or more to every ack- for a
+    usb-serial driver port (ftdi, cp210x, ch341- ttyUSB) the port is set to
+    low latency (ASYNC_LOW_LATENCY, and the latency_timer to 1ms, when
+    allowed), a cdc-acm port (ttyACM, like the curiosity nano) has neither
+    setting- its delay is the usb frame and the bridge firmware, nothing
+    here changes it, and that is printed instead
+    each packet is one write, and the block round trips are printed when
+    done, split into the wire time at the baud rate and the rest (usb,
+    driver, flash write)
+    without flow control it is stop-and-wait (one block in flight, a block
+    out of sequence is cancelled), so the round trip is paid for every
+    block- with -r/-x the data blocks are streamed, -w blocks ahead of the
+    acks, the bootloader holding us back with cts/xoff while it writes
+    flash (its replies then carry a block number, a nack or a timeout goes
+    back to the block it wants)- not with -a, a baud change would catch
+    blocks in flight, and the round trips printed then include the time
+    a block waited behind the ones before it
+
+    a hex or elf file is sent as a sparse image- blocks with no content are
+    skipped, and the block after a skip is sent as an X_SOHA packet with its
+    offset (X_ADDR), with -y the length covers up to the last block so the
+    bootloader erases the skipped pages
+
+    metrics- result (ok, failed, skipped), device signature and serial
+    number (from the sigrow dump), bytes, blocks, time, bytes/s, effective
+    baud (payload bits/s), end baud, nacks, timeouts, baud changes, average
+    block round trip, and the flash dump checked against the image (verify
+    ok, mismatch, or none if no flash dump was read)
+
+    the dump data is- addressL addressH lengthL lengthH data[0]...data[length-1]
+    for each of sigrow, fuses, flash, eeprom
+-----------------------------------------------------------------------------*/
+
+#include "bllink.hpp"
+#include "blimage.hpp"
+#include "blmetrics.hpp"
+#include "blsession.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+                using
+Clock           = std::chrono::steady_clock;
+
+                struct
+Options         {
+                const char* port{ nullptr };
+                const char* file{ nullptr };
+                const char* dumpFile{ nullptr };
+                uint32_t baud{ 230400 };
+                uint32_t appStart{ 2048 };
+                Flow flow{ Flow::None };
+                unsigned window{ 8 }; //data blocks ahead with flow control
+                bool fec{ false };
+                bool ymodem{ false };
+                bool auth{ false };
+                uint32_t key[4]{};
+                bool log{ false };
+                bool go{ false };
+                bool query{ false };
+                const char* jsonFile{ nullptr };
+                const char* promFile{ nullptr };
+                uint8_t dumpMask{ 0 };
+                bool crypt{ false };
+                uint32_t cryptKey[4]{};
+                bool adapt{ false };
+                unsigned nackDown{ 3 }, ackUp{ 32 };
+                uint8_t step{ 0 };
+                unsigned retries{ 10 }; //per block
+                int replyMs{ 0 }; //data block ack wait, 0 = from the measured round trips
+                int endMs{ 5000 };
+                bool lowLatency{ true };
+                };
+
+                //wait for the bootloader ping, it sends one about every second
+                static bool
+waitPing        (Link& link, int seconds)
+                {
+                auto end = Clock::now() + std::chrono::seconds(seconds);
+                while( Clock::now() < end ){
+                    if( link.readCtrl(100) == bl::X_PING ) return true;
+                    }
+                return false;
+                }
+
+                //4 hex words separated by commas
+                static bool
+parseKey        (char* p, uint32_t* key)
+                {
+                for( int k = 0; k < 4; k++ ){
+                    key[k] = strtoul( p, &p, 16 );
+                    if( *p != (k < 3 ? ',' : 0) ) return false;
+                    p++;
+                    }
+                return true;
+                }
+
+                //X_CMD_LOG, print the entries oldest first
+                static bool
+readLog         (Link& link)
+                {
+                std::vector<uint8_t> v;
+                bl::cmdHeader( v, bl::X_CMD_LOG );
+                link.serial().flush();
+                link.write( v );
+                uint8_t hdr[4];
+                if( link.readData(hdr, 4, 500) != 4 ){ fprintf( stderr, "no log (BL_LOG?)\n" ); return false; }
+                std::vector<uint8_t> data( hdr[2] | hdr[3]<<8 );
+                if( link.readData(data.data(), data.size(), 500) != data.size() ) return false;
+                static const char* outcome[16] = { "ok", "FAILED" };
+                for( auto& e : bl::parseLog(data.data(), data.size()) ){
+                    printf( "log %3u  %-10s %5u blocks %5u nacks  %7.2fs  %u baud\n", e.seq,
+                            e.outcome == e.STARTED ? "not ended" : outcome[e.outcome] ? outcome[e.outcome] : "?",
+                            e.blocks, e.nacks, e.ticks/1024.0, link.baud(e.step) );
+                    }
+                return true;
+                }
+
+                //X_CMD_QUERY- true if the app is in place and has the image crc
+                static bool
+appCurrent      (Link& link, const Image& img)
+                {
+                std::vector<uint8_t> v;
+                bl::cmdHeader( v, bl::X_CMD_QUERY );
+                v.push_back( img.bytes.size() );
+                v.push_back( img.bytes.size()>>8 );
+                link.serial().flush();
+                link.write( v );
+                uint8_t r[3];
+                if( link.readData(r, 3, 2000) != 3 ){ fprintf( stderr, "no reply to query (X_QUERY?)\n" ); return false; }
+                uint16_t crc = r[1]<<8 | r[2];
+                uint16_t want = bl::crc16( img.bytes.data(), img.bytes.size() );
+                printf( "app %s  crc %04X, image crc %04X\n", r[0] == 0xFF ? "not programmed" :
+                        r[0] ? "ok, update requested" : "ok", crc, want );
+                return r[0] != 0xFF && crc == want;
+                }
+
+                //run a session to the end on the port (blocking)- before each write the
+                //port follows the session baud step and unread rx is discarded, so a
+                //late reply is not taken for the next one
+                static void
+runSession      (Link& link, bl::Session& s, size_t size, Clock::time_point& uploadEnd)
+                {
+                auto& ser = link.serial();
+                unsigned shown = 0;
+                s.start( Clock::now() );
+                while( true ){
+                    auto v = s.tx();
+                    if( v.size() ){
+                        if( s.baudStep() != link.step() ) link.follow( s.baudStep() );
+                        if( s.dropRx() ) ser.flush(); //stale replies
+                        link.write( v ); //one write, so one usb transfer where possible
+                        }
+                    if( s.stats().blocks != shown ){
+                        shown = s.stats().blocks;
+                        printf( "\r%zu/%zu  %u baud ", std::min(s.position(), size), size, link.baud() );
+                        fflush( stdout );
+                        }
+                    if( s.uploaded() && uploadEnd == Clock::time_point() ) uploadEnd = Clock::now();
+                    if( s.done() ) break;
+                    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>( s.deadline() - Clock::now() ).count();
+                    pollfd p{ ser.fd(), POLLIN, 0 };
+                    if( ::poll(&p, 1, ms < 0 ? 0 : ms+1) > 0 ){
+                        uint8_t buf[256];
+                        ssize_t n = ::read( ser.fd(), buf, sizeof buf );
+                        if( n > 0 ) s.rx( buf, n, Clock::now() );
+                        }
+                    s.poll( Clock::now() );
+                    }
+                if( shown ) printf( "\n" );
+                }
+
+                //dump records as the bootloader sent them, print a summary
+                static std::vector<uint8_t>
+dumpBytes       (const bl::Session& s)
+                {
+                std::vector<uint8_t> dump;
+                for( auto& r : s.dumps() ){
+                    printf( "dump 0x%04X %5u bytes%s\n", r.addr, r.size,
+                            r.data.size() < r.size ? " (incomplete)" : "" );
+                    uint8_t hdr[4] = { uint8_t(r.addr), uint8_t(r.addr>>8), uint8_t(r.size), uint8_t(r.size>>8) };
+                    dump.insert( dump.end(), hdr, hdr+4 );
+                    dump.insert( dump.end(), r.data.begin(), r.data.end() );
+                    }
+                return dump;
+                }
+
+                static void
+usage           ()
+                {
+                fprintf( stderr, "usage: blflash port file [-b baud] [-r|-x] [-w n] [-f] [-y] [-k key] [-e key] [-a down up] [-s step] [-L] [-l blsize] [-d dumpfile] [-g] [-D mask] [-T ms] [-t ms] [-n] [-q] [-m jsonfile] [-p promfile]\n" );
+                exit( 1 );
+                }
+
+                int
+main            (int argc, char** argv)
+                {
+                if( argc < 3 ) usage();
+                Options opt;
+                opt.port = argv[1];
+                opt.file = argv[2];
+                for( int i = 3; i < argc; i++ ){
+                    if( ! strcmp(argv[i], "-b") && i+1 < argc ) opt.baud = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-r") ) opt.flow = Flow::RtsCts;
+                    else if( ! strcmp(argv[i], "-x") ) opt.flow = Flow::XonXoff;
+                    else if( ! strcmp(argv[i], "-w") && i+1 < argc ) opt.window = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-f") ) opt.fec = true;
+                    else if( ! strcmp(argv[i], "-y") ) opt.ymodem = true;
+                    else if( ! strcmp(argv[i], "-a") && i+2 < argc ){
+                        opt.adapt = true;
+                        opt.nackDown = strtoul( argv[++i], 0, 0 );
+                        opt.ackUp = strtoul( argv[++i], 0, 0 );
+                        }
+                    else if( ! strcmp(argv[i], "-s") && i+1 < argc ) opt.step = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-k") && i+1 < argc ){
+                        opt.auth = opt.ymodem = true;
+                        if( ! parseKey(argv[++i], opt.key) ) usage();
+                        }
+                    else if( ! strcmp(argv[i], "-e") && i+1 < argc ){
+                        opt.crypt = opt.ymodem = true;
+                        if( ! parseKey(argv[++i], opt.cryptKey) ) usage();
+                        }
+                    else if( ! strcmp(argv[i], "-L") ) opt.log = true;
+                    else if( ! strcmp(argv[i], "-l") && i+1 < argc ) opt.appStart = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-d") && i+1 < argc ) opt.dumpFile = argv[++i];
+                    else if( ! strcmp(argv[i], "-g") ) opt.go = true;
+                    else if( ! strcmp(argv[i], "-t") && i+1 < argc ) opt.replyMs = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-T") && i+1 < argc ) opt.endMs = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-n") ) opt.lowLatency = false;
+                    else if( ! strcmp(argv[i], "-q") ) opt.query = true;
+                    else if( ! strcmp(argv[i], "-m") && i+1 < argc ) opt.jsonFile = argv[++i];
+                    else if( ! strcmp(argv[i], "-p") && i+1 < argc ) opt.promFile = argv[++i];
+                    else if( ! strcmp(argv[i], "-D") && i+1 < argc ){
+                        opt.go = true;
+                        opt.dumpMask = strtoul( argv[++i], 0, 0 );
+                        }
+                    else usage();
+                    }
+
+                Image img;
+                if( ! loadImage(img, opt.file, opt.appStart) ) return 1;
+
+                Metrics m;
+                m.port = opt.port;
+                m.file = opt.file;
+                m.bytes = img.bytes.size();
+                auto finish = [&](int rc){
+                    if( opt.jsonFile ) writeJsonLine( opt.jsonFile, m );
+                    if( opt.promFile ) writeProm( opt.promFile, m );
+                    return rc;
+                    };
+
+                Serial ser( opt.port );
+                if( ! ser.ok() ){ perror( opt.port ); return finish( 1 ); }
+                if( opt.lowLatency ){
+                    auto set = ser.lowLatency();
+                    auto drv = ser.driver();
+                    if( set.size() ) printf( "port %s\n", set.c_str() );
+                    else if( drv == "cdc_acm" ) printf( "port cdc-acm, no latency settings (usb frame and bridge firmware)\n" );
+                    }
+                Link link( ser, opt.baud, opt.flow );
+                if( ! waitPing(link, 3) ) fprintf( stderr, "no ping seen, trying anyway\n" );
+                if( ! link.setStep(opt.step) ){ fprintf( stderr, "could not set baud step\n" ); return finish( 1 ); }
+
+                if( opt.log ) readLog( link );
+                bl::SessionConfig cfg;
+                cfg.name = strrchr(opt.file, '/') ? strrchr(opt.file, '/')+1 : opt.file;
+                cfg.fec = opt.fec;
+                cfg.ymodem = opt.ymodem;
+                cfg.auth = opt.auth;
+                std::copy( opt.key, opt.key+4, cfg.key );
+                cfg.crypt = opt.crypt;
+                std::copy( opt.cryptKey, opt.cryptKey+4, cfg.cryptKey );
+                //new nonce for every upload, a keystream is never used twice
+                std::random_device rd;
+                cfg.nonce[0] = rd();
+                cfg.nonce[1] = rd();
+                cfg.xonxoff = opt.flow == Flow::XonXoff;
+                cfg.flow = opt.flow != Flow::None;
+                cfg.window = opt.window;
+                cfg.go = opt.go;
+                cfg.dumpMask = opt.dumpMask;
+                cfg.baud = opt.baud;
+                cfg.step = link.step();
+                cfg.adapt = opt.adapt;
+                cfg.nackDown = opt.nackDown;
+                cfg.ackUp = opt.ackUp;
+                cfg.retries = opt.retries;
+                cfg.replyMs = opt.replyMs;
+                cfg.endMs = opt.endMs;
+                cfg.pingMs = 0; //waited for above
+
+                Clock::time_point t = Clock::now(), end;
+                if( opt.query && appCurrent(link, img) ){
+                    printf( "app is current, upload skipped\n" );
+                    m.result = "skipped";
+                    m.bytes = 0;
+                    if( ! opt.go ) return finish( 0 );
+                    cfg.upload = false;
+                    bl::Session s( img, cfg );
+                    runSession( link, s, 0, end );
+                    metricsFromDump( m, dumpBytes(s), img, opt.appStart );
+                    if( s.appRunning() ){ printf( "app running\n" ); return finish( 0 ); }
+                    fprintf( stderr, "%s\n", s.error().c_str() );
+                    m.result = "failed";
+                    return finish( 1 );
+                    }
+
+                bl::Session s( img, cfg );
+                runSession( link, s, img.bytes.size(), end );
+                bool ok = s.uploaded();
+                if( ! ok ){
+                    end = Clock::now();
+                    fprintf( stderr, "%s\n", s.error().c_str() );
+                    }
+                auto& st = s.stats();
+                double secs = std::chrono::duration<double>( end - t ).count();
+                printf( "%s  %u blocks  %u nacks  %u timeouts  %u baud changes  %.2fs  %.0fB/s\n",
+                        ok ? "ok" : "FAILED", st.blocks, st.nacks, st.timeouts, st.stepChanges,
+                        secs, img.bytes.size() / secs );
+                if( st.rttCount ){
+                    double avg = st.rttSum / st.rttCount, wire = st.wireSum / st.rttCount;
+                    printf( "link  rtt %.2f/%.2f/%.2fms min/avg/max  wire %.2fms  other %.2fms per block  "
+                            "ack wait %dms%s\n", st.rttMin, avg, st.rttMax, wire, std::max(0.0, avg - wire), s.replyMs(),
+                            s.window() == 1 && avg > 2*wire ? "  (latency bound, a faster baud gains little)" : "" );
+                    }
+                m.bytes = std::min<size_t>( st.blocks*bl::X_DATA_SIZE, img.bytes.size() ); //sent
+                m.blocks = st.blocks;
+                m.nacks = st.nacks;
+                m.timeouts = st.timeouts;
+                m.stepChanges = st.stepChanges;
+                m.baud = link.baud();
+                m.seconds = secs;
+                m.rttMs = st.rttCount ? st.rttSum / st.rttCount : 0;
+                if( ! ok ) return finish( 1 );
+
+                //with -g/-D the session is only ok if the app runs
+                bool ran = ! opt.go || s.appRunning();
+                m.result = ran ? "ok" : "failed";
+                if( opt.go ){
+                    if( ran ) printf( "app running\n" );
+                    else fprintf( stderr, "%s\n", s.error().c_str() );
+                    }
+                auto dump = dumpBytes( s );
+                if( opt.dumpFile ){
+                    std::ofstream d( opt.dumpFile, std::ios::binary );
+                    d.write( (const char*)dump.data(), dump.size() );
+                    }
+                metricsFromDump( m, dump, img, opt.appStart );
+                if( m.verify == "mismatch" ){
+                    fprintf( stderr, "flash dump does not match the image\n" );
+                    m.result = "failed";
+                    return finish( 1 );
+                    }
+                return finish( ran ? 0 : 1 );
+                }
@@ -0,0 +1,149 @@
+/*-----------------------------------------------------------------------------
+    app image for the host tools- from a bin, intel hex or elf file
+
+    bytes are app offsets (flash address - app start), hex/elf data that is
+    not at or above the app start is an error
+    unused bytes are 0xFF, and used marks each X_DATA_SIZE block that has
+    any content, so a sparse image only needs its used blocks sent (X_ADDR)
+-----------------------------------------------------------------------------*/
+#pragma once
+
+#include "blproto.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+                struct
+Image           {
+
+                std::vector<uint8_t> bytes;
+                std::vector<bool> used; //per X_DATA_SIZE block
+                bool sparse{ false }; //from hex/elf (else bin)
+
+                size_t
+blocks          () const { return used.size(); }
+
+                //block sent as X_SOHA (skips a block before it), else X_SOH
+                bool
+isAddr          (size_t i) const { return i && ! used[i-1]; }
+
+                //add data at a flash address
+                bool
+put             (uint32_t addr, const uint8_t* p, size_t n, uint32_t appStart)
+                {
+                if( addr < appStart ){
+                    fprintf( stderr, "data at 0x%X is below the app start 0x%X\n", addr, appStart );
+                    return false;
+                    }
+                size_t off = addr - appStart;
+                if( off + n > bytes.size() ) bytes.resize( off + n, 0xFF );
+                memcpy( &bytes[off], p, n );
+                used.resize( (bytes.size() + bl::X_DATA_SIZE-1) / bl::X_DATA_SIZE, false );
+                for( size_t i = off / bl::X_DATA_SIZE; i*bl::X_DATA_SIZE < off+n; i++ ) used[i] = true;
+                return true;
+                }
+
+                //block data, last block padded (SUB for a bin file as xmodem does, else 0xFF)
+                void
+block           (size_t i, uint8_t* data) const
+                {
+                size_t pos = i * bl::X_DATA_SIZE;
+                size_t n = std::min<size_t>( bl::X_DATA_SIZE, bytes.size()-pos );
+                memcpy( data, &bytes[pos], n );
+                memset( data+n, sparse ? 0xFF : 0x1A, bl::X_DATA_SIZE-n );
+                }
+
+                };
+
+                //mac of the image as the bootloader will see it (BL_AUTH)
+                inline bl::Mac
+imageMac        (const Image& img, const uint32_t* key)
+                {
+                bl::Mac mac( key, img.bytes.size() );
+                for( size_t i = 0; i < img.blocks(); i++ ){
+                    if( ! img.used[i] ) continue;
+                    size_t pos = i*bl::X_DATA_SIZE;
+                    if( img.isAddr(i) ) mac.offset( pos );
+                    mac.data( &img.bytes[pos], std::min<size_t>(bl::X_DATA_SIZE, img.bytes.size()-pos) );
+                    }
+                return mac;
+                }
+
+                inline bool
+loadBin         (Image& img, const std::vector<uint8_t>& f)
+                {
+                img.bytes = f;
+                img.used.assign( (f.size() + bl::X_DATA_SIZE-1) / bl::X_DATA_SIZE, true );
+                return true;
+                }
+
+                inline bool
+loadHex         (Image& img, const std::vector<uint8_t>& f, uint32_t appStart)
+                {
+                img.sparse = true;
+                std::string s( f.begin(), f.end() );
+                uint32_t base = 0;
+                size_t pos = 0;
+                while( (pos = s.find(':', pos)) != std::string::npos ){
+                    pos++;
+                    std::vector<uint8_t> rec;
+                    while( pos+1 < s.size() && isxdigit(s[pos]) && isxdigit(s[pos+1]) ){
+                        rec.push_back( std::stoul(s.substr(pos, 2), nullptr, 16) );
+                        pos += 2;
+                        }
+                    if( rec.size() < 5 || rec.size() != rec[0] + 5u ){
+                        fprintf( stderr, "bad hex record\n" );
+                        return false;
+                        }
+                    uint8_t sum = 0;
+                    for( auto v : rec ) sum += v;
+                    if( sum ){ fprintf( stderr, "hex checksum error\n" ); return false; }
+                    uint32_t addr = rec[1]<<8 | rec[2];
+                    switch( rec[3] ){
+                        case 0: if( ! img.put(base+addr, &rec[4], rec[0], appStart) ) return false; break;
+                        case 1: return true; //eof
+                        case 2: base = (rec[4]<<8 | rec[5]) << 4; break; //extended segment address
+                        case 4: base = (rec[4]<<8 | rec[5]) << 16; break; //extended linear address
+                        default: break;
+                        }
+                    }
+                return true;
+                }
+
+                //elf32 little endian (avr), PT_LOAD segments with a flash load address
+                inline bool
+loadElf         (Image& img, const std::vector<uint8_t>& f, uint32_t appStart)
+                {
+                img.sparse = true;
+                auto u16 = [&](size_t o){ return uint32_t(f[o] | f[o+1]<<8); };
+                auto u32 = [&](size_t o){ return u16(o) | u16(o+2)<<16; };
+                if( f.size() < 52 || f[4] != 1 || f[5] != 1 ){ fprintf( stderr, "not an elf32 le file\n" ); return false; }
+                uint32_t phoff = u32( 0x1C ), phsize = u16( 0x2A ), phnum = u16( 0x2C );
+                for( uint32_t i = 0; i < phnum; i++ ){
+                    size_t ph = phoff + i*phsize;
+                    if( ph + 32 > f.size() ) return false;
+                    uint32_t type = u32( ph ), offset = u32( ph+4 ), paddr = u32( ph+12 ), filesz = u32( ph+16 );
+                    //avr- flash is 0-0x7FFFFF, ram 0x800000, eeprom 0x810000, fuses 0x820000
+                    if( type != 1 || filesz == 0 || paddr >= 0x800000 ) continue;
+                    if( offset + filesz > f.size() ) return false;
+                    if( ! img.put(paddr, &f[offset], filesz, appStart) ) return false;
+                    }
+                return true;
+                }
+
+                //by file content- elf magic, intel hex ':' start, else binary
+                inline bool
+loadImage       (Image& img, const char* path, uint32_t appStart)
+                {
+                std::ifstream in( path, std::ios::binary );
+                if( ! in ){ perror( path ); return false; }
+                std::vector<uint8_t> f{ std::istreambuf_iterator<char>(in), {} };
+                if( f.size() >= 4 && ! memcmp(f.data(), "\x7F" "ELF", 4) ) return loadElf( img, f, appStart );
+                if( f.size() && f[0] == ':' ) return loadHex( img, f, appStart );
+                return loadBin( img, f );
+                }
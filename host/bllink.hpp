@@ -0,0 +1,107 @@
+/*-----------------------------------------------------------------------------
+    blocking bootloader link for the host tools
+
+    a Serial port plus what the bootloader protocol needs on top of it-
+    baud steps (UART_BAUD>>step), unescaped data reads (xon/xoff mode),
+    and commands
+-----------------------------------------------------------------------------*/
+#pragma once
+
+#include "serial.hpp"
+#include "blproto.hpp"
+#include <chrono>
+#include <thread>
+#include <vector>
+
+                class
+Link            {
+
+                Serial& ser_;
+                Flow flow_;
+                uint32_t baseBaud_;
+                uint8_t step_{ 0 };
+                bl::Unescape unesc_;
+
+public:
+
+Link            (Serial& ser, uint32_t baseBaud, Flow flow = Flow::None)
+                : ser_(ser), flow_(flow), baseBaud_(baseBaud)
+                {
+                ser_.baud( baseBaud_, flow_ );
+                }
+
+                Serial&
+serial          (){ return ser_; }
+
+                Flow
+flow            () const { return flow_; }
+
+                uint8_t
+step            () const { return step_; }
+
+                uint32_t
+baud            () const { return baseBaud_ >> step_; }
+
+                uint32_t
+baud            (uint8_t step) const { return baseBaud_ >> step; }
+
+                //bootloader lost track of (reset), back to its starting rate
+                void
+resetStep       (){ step_ = 0; ser_.baud( baseBaud_, flow_ ); }
+
+                bool
+write           (const std::vector<uint8_t>& v){ return ser_.write( v.data(), v.size() ); }
+
+                //single control byte (ack/nack/ping), -1 if timed out
+                int
+readCtrl        (int timeoutMs){ return ser_.read( timeoutMs ); }
+
+                //read n data bytes (escaped in xon/xoff mode), returns count read
+                size_t
+readData        (uint8_t* buf, size_t n, int timeoutMs)
+                {
+                size_t count = 0;
+                while( count < n ){
+                    int c = ser_.read( timeoutMs );
+                    if( c < 0 ) break;
+                    if( flow_ != Flow::XonXoff ){ buf[count++] = c; continue; }
+                    uint8_t v;
+                    if( unesc_(c, v) ) buf[count++] = v;
+                    }
+                return count;
+                }
+
+                //bootloader changed its rate on its own (BAUD_ADAPT), follow it
+                void
+follow          (uint8_t step)
+                {
+                ser_.drain();
+                step_ = step;
+                ser_.baud( baseBaud_ >> step_, flow_ );
+                }
+
+                //X_CMD_BAUD, returns false if the bootloader did not confirm the new
+                //rate (both ends are then back at the previous rate)
+                bool
+setStep         (uint8_t step)
+                {
+                if( step == step_ ) return true;
+                std::vector<uint8_t> v;
+                bl::cmdHeader( v, bl::X_CMD_BAUD );
+                v.push_back( step );
+                ser_.flush();
+                write( v );
+                if( readCtrl(500) != bl::X_ACK ) return false;
+                ser_.baud( baseBaud_ >> step, flow_ );
+                std::this_thread::sleep_for( std::chrono::milliseconds(20) );
+                ser_.flush();
+                ser_.write( bl::X_CMD_BAUD );
+                if( readCtrl(500) == bl::X_ACK ){ step_ = step; return true; }
+                //bootloader goes back to the previous rate after 1 second
+                std::this_thread::sleep_for( std::chrono::milliseconds(1200) );
+                ser_.baud( baseBaud_ >> step_, flow_ );
+                ser_.flush();
+                return false;
+                }
+
+                };
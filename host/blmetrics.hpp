@@ -0,0 +1,165 @@
+/*-----------------------------------------------------------------------------
+    session metrics for the host tools- a json line per session (appended),
+    and a prometheus text format file (node_exporter textfile collector)
+
+    the text file keeps running totals per port- it is read back, updated
+    and replaced (renamed into place, so a scrape never sees half a file),
+    use a file per station if stations run at the same time
+-----------------------------------------------------------------------------*/
+#pragma once
+
+#include "blimage.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+                struct
+Metrics         {
+                std::string port, file;
+                std::string result{ "failed" }; //ok, failed, skipped
+                std::string signature, serial;  //hex, from a sigrow dump (empty if none)
+                std::string verify{ "none" };   //flash dump against the image- ok, mismatch, none
+                size_t bytes{ 0 };
+                unsigned blocks{ 0 }, nacks{ 0 }, timeouts{ 0 }, stepChanges{ 0 };
+                uint32_t baud{ 0 };             //rate at the end
+                double seconds{ 0 }, rttMs{ 0 };
+
+                double
+bytesPerSec     () const { return seconds > 0 ? bytes / seconds : 0; }
+
+                //payload bits per second, 10 bits per byte as on the wire
+                double
+effectiveBaud   () const { return bytesPerSec() * 10; }
+                };
+
+                inline std::string
+hexString       (const uint8_t* p, size_t n)
+                {
+                std::string s;
+                char b[3];
+                for( size_t i = 0; i < n; i++ ){ snprintf( b, sizeof b, "%02X", p[i] ); s += b; }
+                return s;
+                }
+
+                //device id and verify result from the dump records (addressL addressH
+                //lengthL lengthH data), flash is checked if its record is there- only
+                //the blocks the image uses (the 0xFF between them was not sent, so
+                //the flash there is whatever was left, or erased with -y)
+                inline void
+metricsFromDump (Metrics& m, const std::vector<uint8_t>& dump, const Image& img, uint32_t appStart)
+                {
+                enum { SIGROW = 0x1100 };
+                for( size_t i = 0; i+4 <= dump.size(); ){
+                    unsigned addr = dump[i] | dump[i+1]<<8;
+                    size_t size = std::min<size_t>( dump[i+2] | dump[i+3]<<8, dump.size()-i-4 );
+                    const uint8_t* d = &dump[i+4];
+                    if( addr == SIGROW && size >= 3 ){
+                        m.signature = hexString( d, 3 );
+                        if( size >= 13 ) m.serial = hexString( d+3, 10 ); //SERNUM0-9
+                        }
+                    //mapped flash- 0x8000 (tiny) or 0x4000 (mega), from the boot
+                    //section, or from the app start (BL_AUTH)
+                    if( addr >= 0x4000 ){
+                        size_t off = (addr == 0x4000 || addr == 0x8000) ? appStart : 0;
+                        auto& b = img.bytes;
+                        bool same = off + b.size() <= size;
+                        for( size_t k = 0; same && k < b.size(); k++ ){
+                            same = ! img.used[k / bl::X_DATA_SIZE] || d[off+k] == b[k];
+                            }
+                        m.verify = same ? "ok" : "mismatch";
+                        }
+                    i += 4 + (dump[i+2] | dump[i+3]<<8);
+                    }
+                }
+
+                inline std::string
+jsonString      (const std::string& s)
+                {
+                std::string r = "\"";
+                for( char c : s ){
+                    if( c == '"' || c == '\\' ) r += '\\';
+                    if( (unsigned char)c < 0x20 ) continue;
+                    r += c;
+                    }
+                return r + "\"";
+                }
+
+                inline bool
+writeJsonLine   (const char* path, const Metrics& m)
+                {
+                FILE* f = fopen( path, "a" );
+                if( ! f ){ perror( path ); return false; }
+                fprintf( f, "{\"time\":%lld,\"port\":%s,\"file\":%s,\"result\":\"%s\",\"signature\":%s,"
+                            "\"serial\":%s,\"bytes\":%zu,\"blocks\":%u,\"seconds\":%.3f,\"bytes_per_sec\":%.0f,"
+                            "\"effective_baud\":%.0f,\"baud\":%u,\"nacks\":%u,\"timeouts\":%u,"
+                            "\"baud_changes\":%u,\"rtt_ms\":%.2f,\"verify\":\"%s\"}\n",
+                         (long long)time(0), jsonString(m.port).c_str(), jsonString(m.file).c_str(),
+                         m.result.c_str(), jsonString(m.signature).c_str(), jsonString(m.serial).c_str(),
+                         m.bytes, m.blocks, m.seconds, m.bytesPerSec(), m.effectiveBaud(), m.baud,
+                         m.nacks, m.timeouts, m.stepChanges, m.rttMs, m.verify.c_str() );
+                fclose( f );
+                return true;
+                }
+
+                inline bool
+writeProm       (const char* path, const Metrics& m)
+                {
+                struct Def { const char* name; const char* type; const char* help; };
+                static const Def defs[] = {
+                    { "blflash_sessions_total", "counter", "upload sessions by result" },
+                    { "blflash_bytes_total", "counter", "image bytes sent" },
+                    { "blflash_nacks_total", "counter", "blocks nacked" },
+                    { "blflash_timeouts_total", "counter", "block replies timed out" },
+                    { "blflash_verify_failures_total", "counter", "flash dumps that did not match the image" },
+                    { "blflash_last_success", "gauge", "1 if the last session was ok or skipped" },
+                    { "blflash_last_seconds", "gauge", "last upload duration" },
+                    { "blflash_last_bytes_per_second", "gauge", "last upload throughput" },
+                    { "blflash_last_effective_baud", "gauge", "last upload payload bits per second" },
+                    { "blflash_last_rtt_ms", "gauge", "last upload average block round trip" },
+                    { "blflash_last_timestamp_seconds", "gauge", "time of the last session" },
+                    };
+                //name{labels} value, from the last run
+                std::map<std::string, double> v;
+                {
+                std::ifstream in( path );
+                std::string line;
+                while( std::getline(in, line) ){
+                    if( line.empty() || line[0] == '#' ) continue;
+                    size_t sp = line.rfind( ' ' );
+                    if( sp != std::string::npos ) v[line.substr(0, sp)] = atof( line.c_str()+sp+1 );
+                    }
+                }
+                std::string port = "port=" + jsonString( m.port );
+                v["blflash_sessions_total{" + port + ",result=\"" + m.result + "\"}"] += 1;
+                v["blflash_bytes_total{" + port + "}"] += m.bytes;
+                v["blflash_nacks_total{" + port + "}"] += m.nacks;
+                v["blflash_timeouts_total{" + port + "}"] += m.timeouts;
+                v["blflash_verify_failures_total{" + port + "}"] += m.verify == "mismatch";
+                v["blflash_last_success{" + port + "}"] = m.result != "failed";
+                v["blflash_last_timestamp_seconds{" + port + "}"] = time( 0 );
+                if( m.result != "skipped" ){
+                    v["blflash_last_seconds{" + port + "}"] = m.seconds;
+                    v["blflash_last_bytes_per_second{" + port + "}"] = m.bytesPerSec();
+                    v["blflash_last_effective_baud{" + port + "}"] = m.effectiveBaud();
+                    v["blflash_last_rtt_ms{" + port + "}"] = m.rttMs;
+                    }
+                std::string tmp = std::string( path ) + ".tmp";
+                FILE* f = fopen( tmp.c_str(), "w" );
+                if( ! f ){ perror( tmp.c_str() ); return false; }
+                for( auto& d : defs ){
+                    fprintf( f, "# HELP %s %s\n# TYPE %s %s\n", d.name, d.help, d.name, d.type );
+                    std::string pre = std::string( d.name ) + "{";
+                    for( auto& kv : v ){
+                        if( kv.first.compare(0, pre.size(), pre) ) continue;
+                        fprintf( f, "%s %.10g\n", kv.first.c_str(), kv.second );
+                        }
+                    }
+                fclose( f );
+                if( rename(tmp.c_str(), path) ){ perror( path ); return false; }
+                return true;
+                }
@@ -0,0 +1,134 @@
+/*-----------------------------------------------------------------------------
+    blmulti- upload the same app to several bootloaders at once, one thread
+    (a bl::Session per port, driven from a single poll() loop)
+
+    build-
+    $ g++ -std=c++17 -O2 -o blmulti blmulti.cpp
+
+    use-
+    $ blmulti my_project.bin|.hex|.elf port [port...] [options]
+        -b baud     UART_BAUD the bootloader was compiled with (230400)
+        -r          rts/cts flow control (UART_CTS)
+        -x          xon/xoff flow control (UART_XONXOFF)
+        -w n        data blocks sent ahead with -r/-x (8), 1 = wait for each ack
+        -f          send X_SOHF packets (X_FEC)
+        -y          send a ymodem header (X_YMODEM)
+        -g          run the app when done (X_END), else the dump is read
+        -a down up  adaptive baud, same values as the bootloader
+                    BAUD_NACK_DOWN, BAUD_ACK_UP (BAUD_ADAPT)
+        -l size     BL_SIZE, the app start for hex/elf addresses (2048)
+-----------------------------------------------------------------------------*/
+
+#include "blsession.hpp"
+#include "serial.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+                using
+Clock           = std::chrono::steady_clock;
+
+                struct
+Device          {
+                const char* path;
+                std::unique_ptr<Serial> ser;
+                std::unique_ptr<bl::Session> sess;
+                uint8_t step;   //port baud step
+                };
+
+                static void
+usage           ()
+                {
+                fprintf( stderr, "usage: blmulti file port [port...] [-b baud] [-r|-x] [-w n] [-f] [-y] [-g] [-a down up] [-l blsize]\n" );
+                exit( 1 );
+                }
+
+                int
+main            (int argc, char** argv)
+                {
+                if( argc < 3 ) usage();
+                const char* file = argv[1];
+                std::vector<const char*> ports;
+                uint32_t baud = 230400, appStart = 2048;
+                Flow flow = Flow::None;
+                bl::SessionConfig cfg;
+                for( int i = 2; i < argc; i++ ){
+                    if( argv[i][0] != '-' ) ports.push_back( argv[i] );
+                    else if( ! strcmp(argv[i], "-b") && i+1 < argc ) baud = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-r") ) flow = Flow::RtsCts;
+                    else if( ! strcmp(argv[i], "-x") ) flow = Flow::XonXoff;
+                    else if( ! strcmp(argv[i], "-w") && i+1 < argc ) cfg.window = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-f") ) cfg.fec = true;
+                    else if( ! strcmp(argv[i], "-y") ) cfg.ymodem = true;
+                    else if( ! strcmp(argv[i], "-g") ) cfg.go = true;
+                    else if( ! strcmp(argv[i], "-a") && i+2 < argc ){
+                        cfg.adapt = true;
+                        cfg.nackDown = strtoul( argv[++i], 0, 0 );
+                        cfg.ackUp = strtoul( argv[++i], 0, 0 );
+                        }
+                    else if( ! strcmp(argv[i], "-l") && i+1 < argc ) appStart = strtoul( argv[++i], 0, 0 );
+                    else usage();
+                    }
+                if( ports.empty() ) usage();
+                cfg.xonxoff = flow == Flow::XonXoff;
+                cfg.flow = flow != Flow::None;
+                cfg.baud = baud;
+                cfg.name = strrchr(file, '/') ? strrchr(file, '/')+1 : file;
+
+                Image img;
+                if( ! loadImage(img, file, appStart) ) return 1;
+
+                std::vector<Device> devs;
+                for( auto p : ports ){
+                    auto ser = std::make_unique<Serial>( p );
+                    if( ! ser->ok() || ! ser->baud(baud, flow) ){ perror( p ); continue; }
+                    devs.push_back( { p, std::move(ser), std::make_unique<bl::Session>(img, cfg), 0 } );
+                    devs.back().sess->start( Clock::now() );
+                    }
+
+                while( true ){
+                    std::vector<pollfd> fds;
+                    std::vector<Device*> active;
+                    auto wake = Clock::now() + std::chrono::seconds(10);
+                    for( auto& d : devs ){
+                        if( d.sess->done() ) continue;
+                        fds.push_back( { d.ser->fd(), POLLIN, 0 } );
+                        active.push_back( &d );
+                        wake = std::min( wake, d.sess->deadline() );
+                        }
+                    if( active.empty() ) break;
+                    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>( wake - Clock::now() ).count();
+                    ::poll( fds.data(), fds.size(), ms < 0 ? 0 : ms+1 );
+                    auto now = Clock::now();
+                    for( size_t i = 0; i < active.size(); i++ ){
+                        auto& s = *active[i]->sess;
+                        if( fds[i].revents & POLLIN ){
+                            uint8_t buf[256];
+                            ssize_t n = ::read( fds[i].fd, buf, sizeof buf );
+                            if( n > 0 ) s.rx( buf, n, now );
+                            }
+                        s.poll( now );
+                        auto v = s.tx();
+                        if( v.empty() ) continue;
+                        auto& d = *active[i];
+                        if( s.baudStep() != d.step ){ //BAUD_ADAPT
+                            d.step = s.baudStep();
+                            d.ser->drain();
+                            d.ser->baud( baud >> d.step, flow );
+                            }
+                        if( s.dropRx() ) d.ser->flush(); //stale replies
+                        d.ser->write( v.data(), v.size() );
+                        }
+                    }
+
+                int fails = 0;
+                for( auto& d : devs ){
+                    auto& s = *d.sess;
+                    printf( "%-16s %s  %u/%u blocks  %u nacks  %u timeouts  %zu dumps%s%s\n", d.path,
+                            s.ok() ? "ok" : "FAILED", s.stats().blocks, s.blocks(), s.stats().nacks, s.stats().timeouts,
+                            s.dumps().size(), s.ok() ? "" : "  ", s.error().c_str() );
+                    if( ! s.ok() ) fails++;
+                    }
+                return fails || devs.size() != ports.size();
+                }
@@ -0,0 +1,170 @@
+/*-----------------------------------------------------------------------------
+    blprobe- measure the link to the bootloader, pick the fastest reliable rate
+
+    bootloader needs X_PROBE enabled, and needs to be running (waiting for
+    an xmodem transfer)
+
+    build-
+    $ g++ -std=c++17 -O2 -o blprobe blprobe.cpp
+
+    use-
+    $ blprobe /dev/ttyACM1 [-b 230400] [-n 4096] [-r|-x] [-k]
+        -b  UART_BAUD the bootloader was compiled with
+        -n  bytes to use for each throughput test
+        -r  rts/cts flow control (UART_CTS), -x xon/xoff (UART_XONXOFF)
+        -k  keep the bootloader at the chosen rate when done (else step 0)
+
+    each baud step (UART_BAUD>>step) is tested from fastest to slowest-
+        round trip latency  16 single byte echoes
+        rx throughput       X_CMD_PATTERN, checked against the same lfsr
+        echo throughput     X_CMD_ECHO of n random bytes (with -x, none that
+                            the bootloader has to escape)
+    the fastest step with no errors is reported as the rate for the station
+-----------------------------------------------------------------------------*/
+
+#include "bllink.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+                using
+Clock           = std::chrono::steady_clock;
+
+                static double
+msSince         (Clock::time_point t)
+                {
+                return std::chrono::duration<double, std::milli>( Clock::now() - t ).count();
+                }
+
+                struct
+Result          {
+                bool ok{ false }; //step could be set and tested
+                double rttAvg{ 0 }, rttMax{ 0 }; //ms
+                double rxRate{ 0 }, echoRate{ 0 }; //bytes/s
+                unsigned errors{ 0 }; //bad or missing bytes
+                };
+
+                static void
+testLatency     (Link& link, Result& r)
+                {
+                const int N = 16;
+                double total = 0;
+                int good = 0;
+                for( int i = 0; i < N; i++ ){
+                    std::vector<uint8_t> v;
+                    bl::cmdHeader( v, bl::X_CMD_ECHO );
+                    uint8_t c = 0x55 + i;
+                    v.insert( v.end(), { 1, 0, c } );
+                    auto t = Clock::now();
+                    link.write( v );
+                    uint8_t rx;
+                    if( link.readData(&rx, 1, 200) != 1 || rx != c ){ r.errors++; continue; }
+                    double ms = msSince( t );
+                    total += ms;
+                    good++;
+                    if( ms > r.rttMax ) r.rttMax = ms;
+                    }
+                r.rttAvg = good ? total / good : 0; //errors are counted, not timed
+                }
+
+                static void
+testPattern     (Link& link, Result& r, uint16_t n)
+                {
+                std::vector<uint8_t> v;
+                bl::cmdHeader( v, bl::X_CMD_PATTERN );
+                v.insert( v.end(), { uint8_t(n), uint8_t(n>>8) } );
+                std::vector<uint8_t> rx( n+2 );
+                auto t = Clock::now();
+                link.write( v );
+                size_t got = link.readData( rx.data(), rx.size(), 200 );
+                double ms = msSince( t );
+                uint8_t p = 1;
+                uint16_t crc = 0;
+                for( size_t i = 0; i < n; i++ ){
+                    p = bl::lfsr( p );
+                    crc = bl::crc16( crc, p );
+                    if( i >= got || rx[i] != p ) r.errors++;
+                    }
+                if( got < rx.size() || rx[n] != (crc>>8) || rx[n+1] != (crc & 0xFF) ) r.errors++;
+                r.rxRate = got * 1000.0 / ms;
+                }
+
+                static void
+testEcho        (Link& link, Result& r, uint16_t n)
+                {
+                std::vector<uint8_t> v, data( n ), rx( n );
+                std::mt19937 rng( n );
+                //xon/xoff- the bootloader sends XON XOFF X_ESC back as 2 bytes, so
+                //the echo would fall behind what arrives and overrun its rx
+                for( auto& d : data ){
+                    do d = rng();
+                    while( link.flow() == Flow::XonXoff && (d == bl::X_XON || d == bl::X_XOFF || d == bl::X_ESC) );
+                    }
+                bl::cmdHeader( v, bl::X_CMD_ECHO );
+                v.insert( v.end(), { uint8_t(n), uint8_t(n>>8) } );
+                v.insert( v.end(), data.begin(), data.end() );
+                auto t = Clock::now();
+                link.write( v );
+                size_t got = link.readData( rx.data(), n, 200 );
+                double ms = msSince( t );
+                for( size_t i = 0; i < n; i++ ) if( i >= got || rx[i] != data[i] ) r.errors++;
+                r.echoRate = got * 1000.0 / ms;
+                }
+
+                static void
+usage           ()
+                {
+                fprintf( stderr, "usage: blprobe port [-b baud] [-n bytes] [-r|-x] [-k]\n" );
+                exit( 1 );
+                }
+
+                int
+main            (int argc, char** argv)
+                {
+                if( argc < 2 ) usage();
+                const char* port = argv[1];
+                uint32_t baud = 230400;
+                uint16_t n = 4096;
+                Flow flow = Flow::None;
+                bool keep = false;
+                for( int i = 2; i < argc; i++ ){
+                    if( ! strcmp(argv[i], "-b") && i+1 < argc ) baud = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-n") && i+1 < argc ) n = strtoul( argv[++i], 0, 0 );
+                    else if( ! strcmp(argv[i], "-r") ) flow = Flow::RtsCts;
+                    else if( ! strcmp(argv[i], "-x") ) flow = Flow::XonXoff;
+                    else if( ! strcmp(argv[i], "-k") ) keep = true;
+                    else usage();
+                    }
+
+                Serial ser( port );
+                if( ! ser.ok() ){ perror( port ); return 1; }
+                Link link( ser, baud, flow );
+                ser.flush(); //any pings
+
+                Result results[bl::BAUD_STEPS];
+                int best = -1;
+                for( uint8_t step = 0; step < bl::BAUD_STEPS; step++ ){
+                    Result& r = results[step];
+                    printf( "step %u %7u baud  ", step, baud>>step );
+                    fflush( stdout );
+                    if( ! link.setStep(step) ){ printf( "could not set rate\n" ); continue; }
+                    ser.flush();
+                    r.ok = true;
+                    testLatency( link, r );
+                    testPattern( link, r, n );
+                    testEcho( link, r, n );
+                    printf( "rtt avg %.2fms max %.2fms  rx %.0fB/s  echo %.0fB/s  errors %u\n",
+                            r.rttAvg, r.rttMax, r.rxRate, r.echoRate, r.errors );
+                    if( best < 0 && r.errors == 0 ) best = step;
+                    }
+
+                if( best < 0 ){
+                    printf( "%s: no reliable rate found\n", port );
+                    link.setStep( 0 );
+                    return 1;
+                    }
+                printf( "%s: best step %d, %u baud\n", port, best, baud>>best );
+                link.setStep( keep ? best : 0 );
+                return 0;
+                }
@@ -0,0 +1,271 @@
+/*-----------------------------------------------------------------------------
+    bootloader protocol for the host tools
+
+    values and formats here need to match bootloader.c
+-----------------------------------------------------------------------------*/
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <utility>
+
+                namespace
+bl              {
+
+                enum : uint8_t { //xmodem chars
+X_NACK          = 0x15,
+X_ACK           = 0x06,
+X_SOH           = 0x01,
+X_EOT           = 0x04,
+X_CAN           = 0x18, //cancel (X_YMODEM, image too big)
+X_SOHF          = 0x0E, //SOH with forward error correction (X_FEC)
+X_SOHA          = 0x12, //SOH with a flash offset (X_ADDR)
+X_PING          = 'C',
+X_XON           = 0x11,
+X_XOFF          = 0x13,
+X_ESC           = 0x7D
+                };
+
+                enum : uint8_t { //commands, sent in place of X_SOH- cmd ~cmd [args]
+X_CMD_ECHO      = 'E',
+X_CMD_PATTERN   = 'P',
+X_CMD_BAUD      = 'B',
+X_CMD_LOG       = 'L',
+X_CMD_GO        = 'G', //X_END, after a session or before one
+X_CMD_STAY      = 'S', //X_END
+X_CMD_DUMP      = 'D', //X_END (as 'G'), mask- 1 sigrow, 2 fuses, 4 flash, 8 eeprom
+X_CMD_QUERY     = 'Q'  //X_QUERY, nL nH- reply app ok byte, crcH crcL of n app bytes
+                };
+
+                enum {
+X_DATA_SIZE     = 128,
+BAUD_STEPS      = 4,
+FEC_WAYS        = 2,
+FEC_N           = X_DATA_SIZE/FEC_WAYS
+                };
+
+                inline uint16_t
+crc16           (uint16_t crc, uint8_t v)
+                {
+                crc = crc ^ (v << 8);
+                for( uint8_t i = 0; i < 8; i++ ){
+                    bool b15 = crc & 0x8000;
+                    crc <<= 1;
+                    if (b15) crc ^= 0x1021;
+                    }
+                return crc;
+                }
+
+                inline uint16_t
+crc16           (const uint8_t* p, size_t n, uint16_t crc = 0)
+                {
+                while( n-- ) crc = crc16( crc, *p++ );
+                return crc;
+                }
+
+                //X_CMD_PATTERN data, 8bit galois lfsr (same as bootloader)
+                inline uint8_t
+lfsr            (uint8_t v){ return (v & 1) ? (v>>1) ^ 0xB8 : v>>1; }
+
+                //command header- cmd ~cmd
+                inline void
+cmdHeader       (std::vector<uint8_t>& v, uint8_t cmd)
+                {
+                v.push_back( cmd );
+                v.push_back( ~cmd );
+                }
+
+                //xmodem packet, fec=true adds the X_SOHF check bytes
+                inline std::vector<uint8_t>
+packet          (uint8_t blockNum, const uint8_t* data, bool fec = false)
+                {
+                std::vector<uint8_t> v;
+                v.reserve( 3 + X_DATA_SIZE + 2 + FEC_WAYS*4 );
+                v.push_back( fec ? X_SOHF : X_SOH );
+                v.push_back( blockNum );
+                v.push_back( ~blockNum );
+                v.insert( v.end(), data, data+X_DATA_SIZE );
+                uint16_t crc = crc16( data, X_DATA_SIZE );
+                v.push_back( crc>>8 );
+                v.push_back( crc );
+                if( ! fec ) return v;
+                for( int w = 0; w < FEC_WAYS; w++ ){ //A = sum, B = sum of running A, mod 257
+                    uint16_t a = 0, b = 0;
+                    for( int i = w; i < X_DATA_SIZE; i += FEC_WAYS ){
+                        a = (a + data[i]) % 257;
+                        b = (b + a) % 257;
+                        }
+                    v.push_back( a>>8 ); v.push_back( a );
+                    v.push_back( b>>8 ); v.push_back( b );
+                    }
+                return v;
+                }
+
+                //X_SOHA packet- app offset (multiple of X_DATA_SIZE) in front of the data,
+                //included in the crc
+                inline std::vector<uint8_t>
+packetAddr      (uint8_t blockNum, uint16_t offset, const uint8_t* data)
+                {
+                std::vector<uint8_t> v;
+                v.reserve( 5 + X_DATA_SIZE + 2 );
+                v.push_back( X_SOHA );
+                v.push_back( blockNum );
+                v.push_back( ~blockNum );
+                v.push_back( offset );
+                v.push_back( offset>>8 );
+                v.insert( v.end(), data, data+X_DATA_SIZE );
+                uint16_t crc = crc16( &v[3], 2 + X_DATA_SIZE );
+                v.push_back( crc>>8 );
+                v.push_back( crc );
+                return v;
+                }
+
+                //ymodem block 0 data- name NUL length modtime mode serial NUL
+                //'#' crc [mac0 mac1 [nonce0 nonce1]]
+                //(the bootloader's fields after the standard ones, crc is the xmodem
+                //crc16 of the image, mac for BL_AUTH, nonce for BL_CRYPT- mac is
+                //then 0 0 if not used)
+                //an empty name is the null header that ends a batch
+                inline std::vector<uint8_t>
+yHeader         (const std::string& name, const std::vector<uint8_t>& img,
+                 const uint32_t* mac = nullptr, const uint32_t* nonce = nullptr)
+                {
+                std::vector<uint8_t> v( X_DATA_SIZE, 0 );
+                if( name.empty() ) return v;
+                std::string s = name.substr( 0, 64 );
+                s += '\0';
+                s += std::to_string( img.size() ) + " 0 0 0";
+                s += '\0'; //then the bootloader's own fields, tagged
+                s += "#" + std::to_string( crc16(img.data(), img.size()) );
+                static const uint32_t none[2] = { 0, 0 };
+                if( nonce && ! mac ) mac = none;
+                if( mac ) s += " " + std::to_string( mac[0] ) + " " + std::to_string( mac[1] );
+                if( nonce ) s += " " + std::to_string( nonce[0] ) + " " + std::to_string( nonce[1] );
+                std::copy( s.begin(), s.end(), v.begin() );
+                return v;
+                }
+
+                //speck64/128, encrypt only (BL_AUTH)
+                //s[0] = y, s[1] = x, key = k0 l0 l1 l2 (BL_AUTH_KEY order)
+                class
+Speck           {
+
+                uint32_t rk_[27];
+
+                static uint32_t ror8(uint32_t v){ return (v>>8) | (v<<24); }
+                static uint32_t rol3(uint32_t v){ return (v<<3) | (v>>29); }
+
+public:
+
+Speck           (const uint32_t* key)
+                {
+                uint32_t k = key[0];
+                uint32_t l[3] = { key[1], key[2], key[3] };
+                for( uint32_t i = 0; i < 27; i++ ){
+                    rk_[i] = k;
+                    l[i%3] = (ror8(l[i%3]) + k) ^ i;
+                    k = rol3(k) ^ l[i%3];
+                    }
+                }
+
+                void
+encrypt         (uint32_t* s) const
+                {
+                for( auto k : rk_ ){
+                    s[1] = (ror8(s[1]) + s[0]) ^ k;
+                    s[0] = rol3(s[0]) ^ s[1];
+                    }
+                }
+
+                };
+
+                //image cbc-mac, fed in the same order the bootloader writes (BL_AUTH)
+                class
+Mac             {
+
+                Speck speck_;
+                uint32_t s_[2];
+
+public:
+
+Mac             (const uint32_t* key, uint16_t len) : speck_(key), s_{ len, 0 }
+                {
+                speck_.encrypt( s_ );
+                }
+
+                //X_SOHA packet offset
+                void
+offset          (uint16_t off){ s_[0] ^= off; speck_.encrypt( s_ ); }
+
+                //bytes written, 8 at a time (little endian words), last ones 0 padded
+                void
+data            (const uint8_t* p, size_t n)
+                {
+                for( size_t i = 0; i < n; i++ ){
+                    s_[i%8/4] ^= uint32_t(p[i]) << (i%4*8);
+                    if( i%8 == 7 || i == n-1 ) speck_.encrypt( s_ );
+                    }
+                }
+
+                const uint32_t*
+value           () const { return s_; }
+
+                };
+
+                //speck ctr (BL_CRYPT), en/decrypt X_DATA_SIZE bytes at app offset off
+                //keystream for each 8 bytes- { nonce0 + off/8, nonce1 } encrypted
+                inline void
+ctrCrypt        (const Speck& speck, const uint32_t* nonce, uint16_t off, uint8_t* data)
+                {
+                for( int i = 0; i < X_DATA_SIZE; i += 8 ){
+                    uint32_t s[2] = { nonce[0] + (off+i)/8, nonce[1] };
+                    speck.encrypt( s );
+                    for( int j = 0; j < 8; j++ ) data[i+j] ^= s[j/4] >> (j%4*8);
+                    }
+                }
+
+                //BL_LOG entry- seq outcome|baudStep<<4 blocks nacks ticks (16bit little endian)
+                struct
+LogEntry        {
+                enum : uint8_t { OK = 0, FAILED = 1, STARTED = 0x0F };
+                uint8_t seq, outcome, step;
+                uint16_t blocks, nacks, ticks; //ticks = 1/1024 sec
+                };
+
+                //log data from X_CMD_LOG, oldest first (unwritten entries left out)
+                inline std::vector<LogEntry>
+parseLog        (const uint8_t* p, size_t n)
+                {
+                enum { SIZE = 8 };
+                size_t count = n / SIZE, newest = 0;
+                std::vector<LogEntry> v;
+                if( count == 0 ) return v;
+                while( newest < count-1 && p[(newest+1)*SIZE] == uint8_t(p[newest*SIZE]+1) ) newest++;
+                for( size_t k = 1; k <= count; k++ ){
+                    const uint8_t* e = &p[(newest+k) % count * SIZE];
+                    if( e[1] == 0xFF ) continue;
+                    v.push_back( { e[0], uint8_t(e[1] & 15), uint8_t(e[1] >> 4),
+                                   uint16_t(e[2] | e[3]<<8), uint16_t(e[4] | e[5]<<8), uint16_t(e[6] | e[7]<<8) } );
+                    }
+                return v;
+                }
+
+                //undo the bootloader dump escaping (xon/xoff mode)
+                struct
+Unescape        {
+                bool esc{ false };
+                //returns true if out is a data byte
+                bool
+operator()      (uint8_t in, uint8_t& out)
+                {
+                if( esc ){ esc = false; out = in ^ 0x20; return true; }
+                if( in == X_ESC ){ esc = true; return false; }
+                out = in;
+                return true;
+                }
+                };
+
+                } //namespace bl
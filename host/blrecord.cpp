@@ -0,0 +1,438 @@
+/*-----------------------------------------------------------------------------
+    blrecord- record a bootloader session, and replay the device side of it
+    so host changes can be timed and checked without a board, simulate a
+    device, or check bl::Session against a recording (linux only)
+
+    build-
+    $ g++ -std=c++17 -O2 -o blrecord blrecord.cpp
+
+    use-
+    $ blrecord record /dev/ttyACM1 session.log [-b baud] [-r|-x] [-t seconds]
+        opens a pty and prints its name, run the host tool on the pty- bytes
+        are passed to and from the port and logged both ways with their time
+        (pings before the upload, the upload, the dump stream)
+        ends with ctrl-c, or after -t seconds
+    $ blrecord replay session.log [-f]
+        opens a pty and prints its name, run the host tool on the pty- the
+        recorded device bytes are sent back with the recorded timing, each
+        one after the host bytes that came before it in the recording
+        -f  no device delays, only the ordering (host speed alone)
+        host bytes that differ from the recording are counted (expected if
+        the host sends something random, like a BL_CRYPT nonce)
+    $ blrecord sim [-r|-x] [-d percent] [-w ms] [-F size] [-l blsize] [-s seed]
+        opens a pty and prints its name, answers on it as the bootloader
+        does (no X_END- pings, ymodem header, data packets, EOT, then the
+        sigrow, fuses and flash dump stream)
+        -r, -x      flow control build (numbered replies, blocks streamed),
+                    -x also escapes
+        -d percent  data packets lost on the wire (-s seed, 1)
+        -w ms       flash write time per block (0)
+        -F size     flash size (8192), -l BL_SIZE (2048)
+    $ blrecord check session.log image [-r|-x] [-w n] [-f] [-y] [-l blsize]
+        runs bl::Session on the recorded clock- the recorded device bytes
+        are fed to it, what it writes has to be the recorded host bytes,
+        and the upload has to end ok (exit 0), options as given to blflash
+        when it was recorded (a plain blflash upload, no -L/-q/-s/-e)
+    host/sessions has recordings of blflash against blrecord sim, with the
+    image and the check line for each (the device side is the simulator,
+    not a board)
+
+    log lines- microseconds direction hex, direction h = host to device,
+    d = device to host, # lines are comments
+    the port rate is fixed for a recording- baud changes the host makes on
+    the pty are not passed on (use a session with no baud steps)
+-----------------------------------------------------------------------------*/
+
+#include "blsession.hpp"
+#include "serial.hpp"
+#include <chrono>
+#include <cctype>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+                using
+Clock           = std::chrono::steady_clock;
+
+                struct
+Entry           { uint64_t us; char dir; std::vector<uint8_t> data; };
+
+                static volatile sig_atomic_t
+stop            = 0;
+
+                static void
+onSignal        (int){ stop = 1; }
+
+                //pty master, raw- slave is kept open here too so the master does
+                //not see an error while the host tool has it closed
+                static int
+openPty         (std::string& name)
+                {
+                int m = posix_openpt( O_RDWR|O_NOCTTY );
+                if( m < 0 || grantpt(m) || unlockpt(m) ) return -1;
+                name = ptsname( m );
+                int s = ::open( name.c_str(), O_RDWR|O_NOCTTY );
+                termios2 t;
+                if( s < 0 || ioctl(s, TCGETS2, &t) ) return -1;
+                t.c_iflag = t.c_oflag = t.c_lflag = 0;
+                t.c_cflag = CS8|CREAD|CLOCAL;
+                ioctl( s, TCSETS2, &t );
+                return m;
+                }
+
+                static uint64_t
+usSince         (Clock::time_point t)
+                {
+                return std::chrono::duration_cast<std::chrono::microseconds>( Clock::now() - t ).count();
+                }
+
+                static void
+logEntry        (FILE* f, uint64_t us, char dir, const uint8_t* p, size_t n)
+                {
+                fprintf( f, "%llu %c ", (unsigned long long)us, dir );
+                for( size_t i = 0; i < n; i++ ) fprintf( f, "%02X", p[i] );
+                fprintf( f, "\n" );
+                }
+
+                static int
+record          (const char* port, const char* path, uint32_t baud, Flow flow, int seconds)
+                {
+                Serial ser( port );
+                if( ! ser.ok() || ! ser.baud(baud, flow) ){ perror( port ); return 1; }
+                FILE* f = fopen( path, "w" );
+                if( ! f ){ perror( path ); return 1; }
+                std::string name;
+                int m = openPty( name );
+                if( m < 0 ){ perror( "pty" ); return 1; }
+                printf( "recording %s, host tool port is %s\n", port, name.c_str() );
+                fflush( stdout );
+                fprintf( f, "# blrecord %s %u\n", port, baud );
+                auto t0 = Clock::now();
+                unsigned long long hBytes = 0, dBytes = 0;
+                while( ! stop && (seconds <= 0 || usSince(t0) < seconds*1000000ULL) ){
+                    pollfd p[2] = { { ser.fd(), POLLIN, 0 }, { m, POLLIN, 0 } };
+                    if( ::poll(p, 2, 100) <= 0 ) continue;
+                    uint8_t buf[512];
+                    if( p[0].revents & POLLIN ){
+                        ssize_t n = ::read( ser.fd(), buf, sizeof buf );
+                        if( n > 0 ){ logEntry( f, usSince(t0), 'd', buf, n ); ::write( m, buf, n ); dBytes += n; }
+                        }
+                    if( p[1].revents & POLLIN ){
+                        ssize_t n = ::read( m, buf, sizeof buf );
+                        if( n > 0 ){ logEntry( f, usSince(t0), 'h', buf, n ); ser.write( buf, n ); hBytes += n; }
+                        }
+                    }
+                fclose( f );
+                printf( "%llu host bytes, %llu device bytes, %.2fs\n", hBytes, dBytes, usSince(t0)/1e6 );
+                return 0;
+                }
+
+                static bool
+loadLog         (const char* path, std::vector<Entry>& v)
+                {
+                FILE* f = fopen( path, "r" );
+                if( ! f ){ perror( path ); return false; }
+                char line[4096];
+                while( fgets(line, sizeof line, f) ){
+                    if( line[0] == '#' || line[0] == '\n' ) continue;
+                    Entry e;
+                    char* p;
+                    e.us = strtoull( line, &p, 10 );
+                    while( *p == ' ' ) p++;
+                    e.dir = *p++;
+                    while( *p == ' ' ) p++;
+                    for( ; isxdigit(p[0]) && isxdigit(p[1]); p += 2 ){
+                        char hex[3] = { p[0], p[1], 0 };
+                        e.data.push_back( strtoul(hex, 0, 16) );
+                        }
+                    if( (e.dir != 'h' && e.dir != 'd') || e.data.empty() ){
+                        fprintf( stderr, "bad log line- %s", line );
+                        fclose( f );
+                        return false;
+                        }
+                    v.push_back( std::move(e) );
+                    }
+                fclose( f );
+                return true;
+                }
+
+                static int
+replay          (const char* path, bool fast)
+                {
+                std::vector<Entry> log;
+                if( ! loadLog(path, log) ) return 1;
+                std::string name;
+                int m = openPty( name );
+                if( m < 0 ){ perror( "pty" ); return 1; }
+                printf( "replaying %s, host tool port is %s\n", path, name.c_str() );
+                fflush( stdout );
+                auto anchor = Clock::now(); //device timing is relative to the last host bytes
+                auto start = anchor;
+                bool started = false;
+                uint64_t anchorUs = 0;
+                unsigned long long diffs = 0, hBytes = 0;
+                for( auto& e : log ){
+                    if( stop ) break;
+                    if( e.dir == 'd' ){
+                        if( ! fast ) std::this_thread::sleep_until( anchor + std::chrono::microseconds(e.us - anchorUs) );
+                        ::write( m, e.data.data(), e.data.size() );
+                        continue;
+                        }
+                    for( size_t i = 0; i < e.data.size(); ){
+                        pollfd p{ m, POLLIN, 0 };
+                        if( ::poll(&p, 1, 10000) <= 0 ){
+                            fprintf( stderr, "host stopped, %zu bytes short at %.3fs in the log\n",
+                                     e.data.size()-i, e.us/1e6 );
+                            return 1;
+                            }
+                        uint8_t c;
+                        if( ::read(m, &c, 1) != 1 ) continue;
+                        if( ! started ){ started = true; start = Clock::now(); }
+                        if( c != e.data[i] ) diffs++;
+                        hBytes++;
+                        i++;
+                        }
+                    anchor = Clock::now();
+                    anchorUs = e.us;
+                    }
+                //let the host read the rest
+                std::this_thread::sleep_for( std::chrono::milliseconds(200) );
+                printf( "%llu host bytes, %llu different from the log, %.3fs from the first host byte\n",
+                        hBytes, diffs, std::chrono::duration<double>( anchor - start ).count() );
+                return diffs ? 2 : 0;
+                }
+
+                //device side of an upload on a pty, answered as bootloader.c does
+                //(no X_END- the dump stream follows the upload)
+                struct
+SimConfig       {
+                bool flow{ false };     //UART_CTS/UART_XONXOFF- numbered replies, streaming
+                bool xonxoff{ false };  //replies and dumps escaped
+                int dropPct{ 0 };       //data packets lost on the wire
+                int writeMs{ 0 };       //flash write time per block
+                size_t flashSize{ 8192 };
+                uint32_t blSize{ 2048 };
+                unsigned seed{ 1 };
+                };
+
+                //one byte from the pty master, -1 if none in ms
+                static int
+ptyRead         (int m, int ms)
+                {
+                pollfd p{ m, POLLIN, 0 };
+                uint8_t c;
+                if( ::poll(&p, 1, ms) <= 0 || ::read(m, &c, 1) != 1 ) return -1;
+                return c;
+                }
+
+                static int
+sim             (const SimConfig& cfg)
+                {
+                std::string name;
+                int m = openPty( name );
+                if( m < 0 ){ perror( "pty" ); return 1; }
+                printf( "device simulator, host tool port is %s\n", name.c_str() );
+                fflush( stdout );
+                srand( cfg.seed );
+                std::vector<uint8_t> flash( cfg.flashSize, 0xFF );
+                std::vector<uint8_t> out;
+                auto put = [&](uint8_t c){ //escaped in xon/xoff mode
+                    if( cfg.xonxoff && (c == bl::X_XON || c == bl::X_XOFF || c == bl::X_ESC) ){
+                        out.push_back( bl::X_ESC );
+                        c ^= 0x20;
+                        }
+                    out.push_back( c );
+                    };
+                auto send = [&]{ ::write( m, out.data(), out.size() ); out.clear(); };
+                auto dump = [&](uint16_t addr, const uint8_t* p, uint16_t n){
+                    put( addr ); put( addr>>8 ); put( n ); put( n>>8 );
+                    while( n-- ) put( *p++ );
+                    };
+                uint8_t lastBlock = 0;
+                uint16_t next = 0; //app offset of the next block
+                bool started = false, ymodem = false, nacked = false;
+                auto reply = [&](uint8_t c, uint8_t blk){
+                    out.push_back( c );
+                    if( cfg.flow ) put( blk );
+                    send();
+                    };
+                auto nack = [&](uint8_t blk){
+                    uint8_t ahead = blk - lastBlock;
+                    if( cfg.flow && nacked && ahead >= 2 && ahead < 128 ) return;
+                    reply( bl::X_NACK, lastBlock+1 );
+                    nacked = true;
+                    };
+                auto end = [&]{
+                    static const uint8_t sigrow[3] = { 0x1E, 0x93, 0x20 };
+                    static const uint8_t fuses[9] = {};
+                    dump( 0x1100, sigrow, sizeof sigrow );
+                    dump( 0x1280, fuses, sizeof fuses );
+                    dump( 0x8000, flash.data(), flash.size() );
+                    send();
+                    printf( "session done, %u blocks\n", (unsigned)(next / bl::X_DATA_SIZE) );
+                    fflush( stdout );
+                    std::fill( flash.begin(), flash.end(), 0xFF );
+                    lastBlock = next = 0;
+                    started = ymodem = nacked = false;
+                    };
+                auto pinged = Clock::now();
+                while( ! stop ){
+                    int c = ptyRead( m, 100 );
+                    if( c < 0 ){
+                        if( started || Clock::now() - pinged < std::chrono::seconds(1) ) continue;
+                        out.push_back( bl::X_PING );
+                        send();
+                        pinged = Clock::now();
+                        continue;
+                        }
+                    if( c == bl::X_EOT && started ){
+                        reply( bl::X_ACK, lastBlock+1 );
+                        if( ! ymodem ){ end(); continue; }
+                        out.push_back( bl::X_PING ); //next file, the host sends a null header
+                        send();
+                        continue;
+                        }
+                    if( c != bl::X_SOH && c != bl::X_SOHF && c != bl::X_SOHA ) continue;
+                    started = true;
+                    uint8_t pkt[4 + bl::X_DATA_SIZE + 2 + bl::FEC_WAYS*4];
+                    size_t n = 2 + (c == bl::X_SOHA ? 2 : 0) + bl::X_DATA_SIZE + 2 + (c == bl::X_SOHF ? bl::FEC_WAYS*4 : 0);
+                    size_t i = 0;
+                    for( int v; i < n && (v = ptyRead(m, 1000)) >= 0; i++ ) pkt[i] = v;
+                    if( rand() % 100 < cfg.dropPct ) continue; //lost on the wire
+                    uint8_t blk = pkt[0];
+                    const uint8_t* data = &pkt[c == bl::X_SOHA ? 4 : 2];
+                    size_t crcLen = bl::X_DATA_SIZE + (c == bl::X_SOHA ? 2 : 0);
+                    uint16_t crc = bl::crc16( &pkt[2], crcLen );
+                    if( i < n || uint8_t(pkt[0] + pkt[1]) != 0xFF || crc != (pkt[2+crcLen]<<8 | pkt[3+crcLen]) ){
+                        nack( blk );
+                        continue;
+                        }
+                    if( blk == 0 ){ //ymodem header, or the null header that ends the batch
+                        reply( bl::X_ACK, 0 );
+                        if( data[0] == 0 ){ end(); continue; }
+                        ymodem = true;
+                        out.push_back( bl::X_PING ); //ready for data
+                        send();
+                        continue;
+                        }
+                    if( blk == lastBlock ){ reply( bl::X_ACK, blk ); continue; } //already written
+                    if( blk != uint8_t(lastBlock+1) ){
+                        if( ! cfg.flow ){ out = { bl::X_CAN, bl::X_CAN }; send(); end(); continue; }
+                        if( uint8_t(blk - lastBlock) >= 128 ) reply( bl::X_ACK, blk );
+                        else nack( blk );
+                        continue;
+                        }
+                    if( c == bl::X_SOHA ) next = pkt[2] | pkt[3]<<8;
+                    if( cfg.blSize + next + bl::X_DATA_SIZE > flash.size() ){ out = { bl::X_CAN, bl::X_CAN }; send(); end(); continue; }
+                    std::copy( data, data + bl::X_DATA_SIZE, &flash[cfg.blSize + next] );
+                    next += bl::X_DATA_SIZE;
+                    if( cfg.writeMs ) std::this_thread::sleep_for( std::chrono::milliseconds(cfg.writeMs) );
+                    lastBlock = blk;
+                    nacked = false;
+                    reply( bl::X_ACK, blk );
+                    }
+                return 0;
+                }
+
+                //run bl::Session on the clock of a recorded blflash upload- the
+                //device bytes are its rx, its tx has to match the host bytes
+                static int
+check           (const char* path, const char* file, bl::SessionConfig cfg, uint32_t appStart)
+                {
+                std::vector<Entry> log;
+                if( ! loadLog(path, log) ) return 1;
+                Image img;
+                if( ! loadImage(img, file, appStart) ) return 1;
+                auto first = std::find_if( log.begin(), log.end(), [](const Entry& e){ return e.dir == 'h'; } );
+                if( first == log.end() ){ fprintf( stderr, "no host bytes in %s\n", path ); return 1; }
+                cfg.name = strrchr(file, '/') ? strrchr(file, '/')+1 : file;
+                cfg.pingMs = 0; //blflash waits for the ping before the session
+                bl::Session s( img, cfg );
+                auto at = [](uint64_t us){ return bl::Time() + std::chrono::microseconds(us); };
+                std::vector<uint8_t> want, got;
+                auto take = [&]{ auto v = s.tx(); got.insert( got.end(), v.begin(), v.end() ); };
+                s.start( at(first->us) );
+                take();
+                for( auto e = first; e != log.end(); ++e ){
+                    while( ! s.done() && s.deadline() <= at(e->us) ){ s.poll( s.deadline() ); take(); }
+                    if( e->dir == 'h' ) want.insert( want.end(), e->data.begin(), e->data.end() );
+                    else if( ! s.done() ){ s.rx( e->data.data(), e->data.size(), at(e->us) ); take(); }
+                    }
+                while( ! s.done() ){ s.poll( s.deadline() ); take(); }
+                size_t same = std::mismatch( want.begin(), want.end(), got.begin(), got.end() ).first - want.begin();
+                printf( "%zu host bytes in the log, %zu from the session", want.size(), got.size() );
+                if( got != want ) printf( ", first difference at byte %zu", same );
+                printf( "\nsession %s  %u blocks  %u nacks  %u timeouts  %zu dumps%s%s\n", s.ok() ? "ok" : "FAILED",
+                        s.stats().blocks, s.stats().nacks, s.stats().timeouts, s.dumps().size(),
+                        s.ok() ? "" : "  ", s.error().c_str() );
+                return got == want && s.ok() ? 0 : 2;
+                }
+
+                static void
+usage           ()
+                {
+                fprintf( stderr, "usage: blrecord record port file [-b baud] [-r|-x] [-t seconds]\n"
+                                 "       blrecord replay file [-f]\n"
+                                 "       blrecord sim [-r|-x] [-d percent] [-w ms] [-F size] [-l blsize] [-s seed]\n"
+                                 "       blrecord check file image [-r|-x] [-w n] [-f] [-y] [-l blsize]\n" );
+                exit( 1 );
+                }
+
+                int
+main            (int argc, char** argv)
+                {
+                signal( SIGINT, onSignal );
+                if( argc >= 2 && ! strcmp(argv[1], "sim") ){
+                    SimConfig cfg;
+                    for( int i = 2; i < argc; i++ ){
+                        if( ! strcmp(argv[i], "-r") ) cfg.flow = true;
+                        else if( ! strcmp(argv[i], "-x") ) cfg.flow = cfg.xonxoff = true;
+                        else if( ! strcmp(argv[i], "-d") && i+1 < argc ) cfg.dropPct = atoi( argv[++i] );
+                        else if( ! strcmp(argv[i], "-w") && i+1 < argc ) cfg.writeMs = atoi( argv[++i] );
+                        else if( ! strcmp(argv[i], "-F") && i+1 < argc ) cfg.flashSize = strtoul( argv[++i], 0, 0 );
+                        else if( ! strcmp(argv[i], "-l") && i+1 < argc ) cfg.blSize = strtoul( argv[++i], 0, 0 );
+                        else if( ! strcmp(argv[i], "-s") && i+1 < argc ) cfg.seed = strtoul( argv[++i], 0, 0 );
+                        else usage();
+                        }
+                    if( cfg.blSize >= cfg.flashSize ) usage();
+                    return sim( cfg );
+                    }
+                if( argc < 3 ) usage();
+                if( ! strcmp(argv[1], "record") && argc >= 4 ){
+                    uint32_t baud = 230400;
+                    Flow flow = Flow::None;
+                    int seconds = 0;
+                    for( int i = 4; i < argc; i++ ){
+                        if( ! strcmp(argv[i], "-b") && i+1 < argc ) baud = strtoul( argv[++i], 0, 0 );
+                        else if( ! strcmp(argv[i], "-r") ) flow = Flow::RtsCts;
+                        else if( ! strcmp(argv[i], "-x") ) flow = Flow::XonXoff;
+                        else if( ! strcmp(argv[i], "-t") && i+1 < argc ) seconds = atoi( argv[++i] );
+                        else usage();
+                        }
+                    return record( argv[2], argv[3], baud, flow, seconds );
+                    }
+                if( ! strcmp(argv[1], "replay") ){
+                    bool fast = argc > 3 && ! strcmp(argv[3], "-f");
+                    return replay( argv[2], fast );
+                    }
+                if( ! strcmp(argv[1], "check") && argc >= 4 ){
+                    bl::SessionConfig cfg; //as blflash sets it
+                    uint32_t appStart = 2048;
+                    for( int i = 4; i < argc; i++ ){
+                        if( ! strcmp(argv[i], "-r") ) cfg.flow = true;
+                        else if( ! strcmp(argv[i], "-x") ) cfg.flow = cfg.xonxoff = true;
+                        else if( ! strcmp(argv[i], "-w") && i+1 < argc ) cfg.window = strtoul( argv[++i], 0, 0 );
+                        else if( ! strcmp(argv[i], "-f") ) cfg.fec = true;
+                        else if( ! strcmp(argv[i], "-y") ) cfg.ymodem = true;
+                        else if( ! strcmp(argv[i], "-l") && i+1 < argc ) appStart = strtoul( argv[++i], 0, 0 );
+                        else usage();
+                        }
+                    return check( argv[2], argv[3], cfg, appStart );
+                    }
+                usage();
+                return 1;
+                }
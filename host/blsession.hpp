@@ -0,0 +1,535 @@
+/*-----------------------------------------------------------------------------
+    non-blocking bootloader session for the host tools (no io of its own)
+
+    Session is a state machine for one upload- the caller owns the port and
+    the event loop, so one thread can run any number of devices
+        rx( buf, n, now )   feed the bytes the port read
+        tx()                bytes to write now (empty if none), take it after
+                            every rx/poll- before writing, set the port to
+                            baudStep() if it changed, and if dropRx()
+                            discard any unread rx (a late reply to the last
+                            try would otherwise be taken as the reply to
+                            this one)
+        deadline()          latest time to call poll() if nothing is read
+        poll( now )         handles the timeouts
+        done(), ok()        finished, and how
+    nothing blocks, so it fits a poll/epoll loop, asio, or a coroutine that
+    awaits readable-or-deadline and then calls rx/poll and writes tx()
+    (blmulti.cpp runs several ports from one poll() loop, blflash.cpp one
+    port from a blocking loop- the upload sequencing is only here)
+
+    covers- ping wait, ymodem header (with mac and nonce), X_SOH/X_SOHF/X_SOHA
+    blocks, ack/nack/cancel with retries, streaming with flow control
+    (cfg.window blocks ahead, numbered replies, go back on a nack/timeout),
+    BAUD_ADAPT step following, the data block ack wait from the measured
+    round trips, EOT, ymodem null
+    header, then the dump stream (parsed into records), or X_END- the
+    ready ping (cfg.endMs, the bootloader checks the image first), dumps
+    and run app (also on their own, upload = false, no ping then)
+    not covered- X_CMD_BAUD, log, query (a blocking Link does those
+    before the session)
+-----------------------------------------------------------------------------*/
+#pragma once
+
+#include "blimage.hpp"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+                namespace
+bl              {
+
+                using
+Time            = std::chrono::steady_clock::time_point;
+
+                struct
+SessionConfig   {
+                std::string name;       //ymodem file name
+                bool upload{ true };    //false- only the X_END part (go set)
+                bool fec{ false };      //X_SOHF packets
+                bool ymodem{ false };   //header with length and crc
+                bool auth{ false };     //BL_AUTH, mac in the header (needs ymodem)
+                uint32_t key[4]{};
+                bool crypt{ false };    //BL_CRYPT (needs ymodem)
+                uint32_t cryptKey[4]{};
+                uint32_t nonce[2]{};    //caller picks a new one for every upload
+                bool xonxoff{ false };  //dump data (and reply block numbers) are escaped
+                bool flow{ false };     //UART_CTS/UART_XONXOFF- replies carry a block number,
+                unsigned window{ 8 };   //and this many data blocks are sent ahead (not with adapt)
+                bool go{ false };       //X_END- run the app when done, no dump stream
+                uint8_t dumpMask{ 0 };  //X_END- dumps to read before the go
+                uint32_t baud{ 230400 }; //UART_BAUD, for the wire time
+                uint8_t step{ 0 };      //baud step at the start (X_CMD_BAUD done)
+                bool adapt{ false };    //BAUD_ADAPT, same values as the bootloader
+                unsigned nackDown{ 3 }, ackUp{ 32 };
+                unsigned retries{ 10 }; //per packet
+                int pingMs{ 3000 };     //first ping wait (continues without one), 0 = none
+                int replyMs{ 0 };       //data block ack wait, 0 = from the round trips
+                int eraseMs{ 10000 };   //header ack wait (bootloader erases first)
+                int quietMs{ 1000 };    //dump stream end
+                int endMs{ 5000 };      //X_END ready ping wait (image checks, eeprom writes)
+                };
+
+                //dump record- addressL addressH lengthL lengthH data (size is the
+                //length sent, data is short of it if the stream stopped)
+                struct
+DumpRecord      { uint16_t addr, size; std::vector<uint8_t> data; };
+
+                struct
+SessionStats    {
+                unsigned blocks{ 0 }, nacks{ 0 }, timeouts{ 0 }, stepChanges{ 0 };
+                //data block round trips (write to ack), and the part of it that is
+                //the bytes on the wire at the baud rate- the rest is the usb/driver
+                //and bootloader (flash write) time
+                unsigned rttCount{ 0 };
+                double rttMin{ 1e9 }, rttMax{ 0 }, rttSum{ 0 }, wireSum{ 0 };
+
+                void
+rtt             (double ms, double wireMs)
+                {
+                rttCount++;
+                rttMin = std::min( rttMin, ms );
+                rttMax = std::max( rttMax, ms );
+                rttSum += ms;
+                wireSum += wireMs;
+                }
+
+                //ack wait for a data block- 1s until there are enough round trips to go by
+                int
+replyMs         (int fixedMs) const
+                {
+                if( fixedMs ) return fixedMs;
+                if( rttCount < 8 ) return 1000;
+                return std::max( 100, int(rttMax*4) + 20 );
+                }
+                };
+
+                class
+Session         {
+
+public:
+
+                enum State { Ping, Send, Dump, EndWait, EndDump, EndGo, Done, Failed };
+
+private:
+
+                struct Step {
+                    std::vector<uint8_t> bytes;
+                    int timeoutMs;      //0 = data block ack wait
+                    bool pingAfter;     //bootloader pings again after the ack
+                    bool block;         //data block (counted for progress)
+                    bool counted;       //packet, the bootloader counts its acks/nacks
+                    size_t end;         //image offset after it (progress)
+                    Time sent{};
+                    };
+
+                SessionConfig cfg_;
+                std::vector<Step> steps_;
+                size_t step_{ 0 };      //oldest step not acked
+                size_t next_{ 0 };      //next step to send, data blocks step_ to next_ are in flight
+                unsigned window_;       //data blocks in flight, 1 = wait for each ack
+                uint8_t replyType_{ 0 }; //flow- ACK/NACK seen, its block number is next
+                Unescape replyUnesc_;
+                State state_{ Ping };
+                Time deadline_;
+                unsigned tries_{ 0 };
+                std::vector<uint8_t> tx_;
+                std::string error_;
+                Unescape unesc_;
+                std::vector<uint8_t> hdr_;  //dump record header in progress
+                std::vector<DumpRecord> dumps_;
+                unsigned dumpsLeft_{ 0 };
+                unsigned blocks_{ 0 };
+                size_t position_{ 0 };
+                SessionStats stats_;
+                //mirror of the bootloader BAUD_ADAPT streak counting
+                uint8_t baudStep_;
+                unsigned acks_{ 0 }, nacks_{ 0 };
+                unsigned lost_{ 0 };    //replies lost in a row
+                uint8_t lostStep_{ 0 }; //step when the first one was lost
+                bool uploaded_{ false }, appRunning_{ false };
+
+                static Time
+after           (Time now, int ms){ return now + std::chrono::milliseconds(ms); }
+
+                void
+fail            (const std::string& e){ error_ = e; state_ = Failed; }
+
+                void
+adaptAck        ()
+                {
+                if( ! cfg_.adapt ) return;
+                nacks_ = lost_ = 0;
+                if( ++acks_ < cfg_.ackUp ) return;
+                acks_ = 0;
+                if( baudStep_ == 0 ) return;
+                baudStep_--;
+                stats_.stepChanges++;
+                }
+
+                void
+adaptNack       ()
+                {
+                if( ! cfg_.adapt ) return;
+                acks_ = lost_ = 0;
+                if( ++nacks_ < cfg_.nackDown ) return;
+                nacks_ = 0;
+                if( baudStep_ == BAUD_STEPS-1 ) return;
+                baudStep_++;
+                stats_.stepChanges++;
+                }
+
+                //lost a reply- usually a packet the bootloader did not see (noise), so
+                //the rates still match and the same step is tried again first, then
+                //one down (a nack that moved it down was lost), one up, and further out
+                void
+adaptLost       ()
+                {
+                if( ! cfg_.adapt ) return;
+                static const int order[] = { 0, 1, -1, 2, -2, 3, -3 };
+                enum { N = sizeof order / sizeof order[0] };
+                acks_ = nacks_ = 0;
+                if( lost_ == 0 ) lostStep_ = baudStep_;
+                while( true ){
+                    int s = lostStep_ + order[lost_++ % N];
+                    if( s < 0 || s >= BAUD_STEPS ) continue;
+                    baudStep_ = s;
+                    return;
+                    }
+                }
+
+                //flow control build- packet and EOT replies carry a block number
+                bool
+numbered        () const { return cfg_.flow; }
+
+                bool
+isEot           (const Step& s) const { return s.bytes[0] == X_EOT; }
+
+                static uint8_t
+blockNum        (const Step& s){ return s.bytes[1]; }
+
+                //reply wait, from when the oldest step in flight was sent
+                void
+waitBase        ()
+                {
+                auto& s = steps_[step_];
+                deadline_ = after( s.sent, s.timeoutMs ? s.timeoutMs : stats_.replyMs(cfg_.replyMs) );
+                }
+
+                //queue data blocks from next_ up to the window
+                void
+fill            (Time now)
+                {
+                while( next_ < steps_.size() && steps_[next_].block && next_ - step_ < window_ ){
+                    auto& s = steps_[next_++];
+                    tx_.insert( tx_.end(), s.bytes.begin(), s.bytes.end() );
+                    s.sent = now;
+                    }
+                }
+
+                //(re)send from step_- data blocks fill the window, anything else goes alone
+                void
+send            (Time now)
+                {
+                auto& s = steps_[step_];
+                state_ = Send;
+                next_ = step_;
+                if( s.block ) fill( now );
+                else{
+                    tx_.insert( tx_.end(), s.bytes.begin(), s.bytes.end() );
+                    s.sent = now;
+                    next_++;
+                    }
+                waitBase();
+                }
+
+                //steps before to are acked
+                void
+ackTo           (size_t to, Time now)
+                {
+                if( to > step_ ) tries_ = 0;
+                for( ; step_ < to; step_++ ){
+                    auto& s = steps_[step_];
+                    if( ! s.block ) continue;
+                    stats_.blocks++;
+                    stats_.rtt( std::chrono::duration<double, std::milli>( now - s.sent ).count(),
+                                (s.bytes.size()+1) * 10000.0 / baud() );
+                    position_ = s.end;
+                    }
+                }
+
+                //n = block number of a numbered reply
+                void
+acked           (uint8_t n, Time now)
+                {
+                size_t to = step_+1;
+                if( isEot(steps_[step_]) && numbered() ){ //acks to blocks sent again come first
+                    bool data = step_ && steps_[step_-1].block;
+                    if( n != uint8_t(data ? blockNum(steps_[step_-1])+1 : 1) ) return;
+                    }
+                if( steps_[step_].block && numbered() ){
+                    size_t d = uint8_t( n - blockNum(steps_[step_]) );
+                    if( d >= next_ - step_ ) return; //old, a block acked again
+                    to = step_ + d + 1;
+                    }
+                bool ping = steps_[to-1].pingAfter;
+                ackTo( to, now );
+                if( step_ == steps_.size() ){ end( now ); return; }
+                if( next_ > step_ ){ fill( now ); waitBase(); return; } //blocks still in flight
+                if( ping ){ state_ = Ping; deadline_ = after( now, 2000 ); }
+                else send( now );
+                }
+
+                //go back to the block wanted (blocks before it are written)
+                void
+nacked          (uint8_t n, Time now)
+                {
+                if( isEot(steps_[step_]) && numbered() ) return; //to a block sent again
+                stats_.nacks++;
+                if( steps_[step_].block && numbered() ){
+                    size_t d = uint8_t( n - blockNum(steps_[step_]) );
+                    if( d < next_ - step_ ) ackTo( step_+d, now );
+                    }
+                if( ++tries_ >= cfg_.retries ){ fail( "block failed" ); return; }
+                send( now );
+                }
+
+                //upload done (or none)- the dump stream, or X_END
+                void
+end             (Time now)
+                {
+                uploaded_ = cfg_.upload;
+                if( ! cfg_.go ){
+                    if( ! cfg_.upload ){ state_ = Done; return; }
+                    state_ = Dump;
+                    deadline_ = after( now, cfg_.quietMs );
+                    return;
+                    }
+                //after an upload the bootloader pings when it is ready for a command
+                if( cfg_.upload ){ state_ = EndWait; deadline_ = after( now, cfg_.endMs ); return; }
+                endCommands( now );
+                }
+
+                //X_END- dumps (if any), then run app
+                void
+endCommands     (Time now)
+                {
+                if( cfg_.dumpMask & 15 ){
+                    cmdHeader( tx_, X_CMD_DUMP );
+                    tx_.push_back( cfg_.dumpMask );
+                    dumpsLeft_ = __builtin_popcount( cfg_.dumpMask & 15 );
+                    state_ = EndDump;
+                    deadline_ = after( now, 500 );
+                    return;
+                    }
+                go( now );
+                }
+
+                void
+go              (Time now)
+                {
+                cmdHeader( tx_, X_CMD_GO );
+                state_ = EndGo;
+                deadline_ = after( now, 500 );
+                }
+
+                //dump data byte, returns true when a record is complete
+                bool
+dumpByte        (uint8_t c)
+                {
+                if( hdr_.size() < 4 ){
+                    hdr_.push_back( c );
+                    if( hdr_.size() < 4 ) return false;
+                    dumps_.push_back( { uint16_t(hdr_[0] | hdr_[1]<<8), uint16_t(hdr_[2] | hdr_[3]<<8), {} } );
+                    dumps_.back().data.reserve( dumps_.back().size );
+                    }
+                else dumps_.back().data.push_back( c );
+                if( dumps_.back().data.size() < dumps_.back().size ) return false;
+                hdr_.clear();
+                return true;
+                }
+
+                void
+reply           (uint8_t c, Time now)
+                {
+                if( replyType_ ){ //block number after an ACK/NACK
+                    uint8_t n;
+                    if( cfg_.xonxoff && ! replyUnesc_(c, n) ) return;
+                    if( ! cfg_.xonxoff ) n = c;
+                    uint8_t t = replyType_;
+                    replyType_ = 0;
+                    if( t == X_ACK ) acked( n, now ); else nacked( n, now );
+                    return;
+                    }
+                if( c == X_CAN ){ fail( "cancelled, image too big, no header, or block out of sequence" ); return; }
+                if( c != X_ACK && c != X_NACK ) return; //ping or noise
+                bool counted = steps_[step_].counted;
+                if( counted && c == X_ACK ) adaptAck();
+                if( counted && c == X_NACK ) adaptNack();
+                if( (counted || isEot(steps_[step_])) && numbered() ){ replyType_ = c; return; }
+                if( c == X_ACK ) acked( 0, now ); else nacked( 0, now );
+                }
+
+public:
+
+Session         (const Image& img, const SessionConfig& cfg)
+                : cfg_(cfg), window_(1), baudStep_(cfg.step)
+                {
+                //streaming needs the numbered replies, and both ends at the same
+                //rate (a BAUD_ADAPT change would catch blocks in flight)
+                if( cfg_.flow && ! cfg_.adapt ) window_ = std::max( 1u, std::min(cfg_.window, 127u) );
+                if( cfg_.ymodem ){
+                    auto mac = imageMac( img, cfg_.key );
+                    auto h = yHeader( cfg_.name, img.bytes, cfg_.auth ? mac.value() : nullptr,
+                                      cfg_.crypt ? cfg_.nonce : nullptr );
+                    steps_.push_back( { packet(0, h.data(), cfg_.fec), cfg_.eraseMs, true, false, true, 0 } );
+                    }
+                Speck speck( cfg_.cryptKey );
+                uint8_t blockNum = 1;
+                for( size_t i = 0; i < img.blocks(); i++ ){
+                    if( ! img.used[i] ) continue;
+                    uint8_t data[X_DATA_SIZE];
+                    img.block( i, data );
+                    if( cfg_.crypt ) ctrCrypt( speck, cfg_.nonce, i*X_DATA_SIZE, data );
+                    steps_.push_back( { img.isAddr(i) ? packetAddr(blockNum, i*X_DATA_SIZE, data)
+                                                      : packet(blockNum, data, cfg_.fec),
+                                        0, false, true, true, (i+1)*X_DATA_SIZE } );
+                    blockNum++;
+                    blocks_++;
+                    }
+                //EOT is not a packet, the bootloader does not count it
+                steps_.push_back( { { X_EOT }, 1000, cfg_.ymodem, false, false, 0 } );
+                //end of batch- null header (bootloader verifies the image crc/mac after this)
+                if( cfg_.ymodem ) steps_.push_back( { packet(0, yHeader("", img.bytes).data(), cfg_.fec),
+                                                      2000, false, false, true, 0 } );
+                }
+
+                //call once the port is open (and at cfg.step)
+                void
+start           (Time now)
+                {
+                if( ! cfg_.upload ){ end( now ); return; }
+                if( cfg_.pingMs ){ state_ = Ping; deadline_ = after( now, cfg_.pingMs ); }
+                else send( now );
+                }
+
+                //without numbered replies, once a new write is queued the rest of buf
+                //came before it, and is dropped as the caller flushes the port
+                void
+rx              (const uint8_t* buf, size_t n, Time now)
+                {
+                for( size_t i = 0; i < n && ! done() && (tx_.empty() || numbered()); i++ ){
+                    uint8_t c = buf[i];
+                    switch( state_ ){
+                        case Ping: if( c == X_PING ) send( now ); break;
+                        case Send: reply( c, now ); break;
+                        case Dump:
+                        case EndDump: {
+                            uint8_t v;
+                            if( cfg_.xonxoff && ! unesc_(c, v) ) break;
+                            if( ! cfg_.xonxoff ) v = c;
+                            bool rec = dumpByte( v );
+                            deadline_ = after( now, state_ == Dump ? cfg_.quietMs : 500 );
+                            if( state_ == EndDump && rec && --dumpsLeft_ == 0 ) go( now );
+                            break;
+                            }
+                        //ping, or the dump stream of a bootloader without X_END
+                        case EndWait:
+                            if( c == X_PING ) endCommands( now );
+                            else if( c != X_XON && c != X_XOFF && c != X_ACK && c != X_NACK ) fail( "dump data, no end commands (X_END?)" );
+                            break;
+                        //only reached once the dump records are all in
+                        case EndGo:
+                            if( c == X_ACK ){ appRunning_ = true; state_ = Done; }
+                            else if( c == X_NACK ) fail( "no app to run" );
+                            break;
+                        default: break;
+                        }
+                    }
+                }
+
+                void
+poll            (Time now)
+                {
+                if( done() || now < deadline_ ) return;
+                switch( state_ ){
+                    case Ping: send( now ); break; //no ping seen, try anyway
+                    case Send:
+                        stats_.timeouts++;
+                        if( steps_[step_].counted ) adaptLost();
+                        if( ++tries_ >= cfg_.retries ){ fail( "no reply" ); break; }
+                        replyType_ = 0;
+                        send( now );
+                        break;
+                    case Dump: state_ = Done; break; //stream went quiet
+                    case EndWait: fail( "no ping for the end commands (X_END?)" ); break;
+                    case EndDump: fail( "dump incomplete" ); break; //may still be sending, no go
+                    case EndGo: fail( "no reply to run command (X_END?)" ); break;
+                    default: break;
+                    }
+                }
+
+                //bytes to write, taken by the caller
+                std::vector<uint8_t>
+tx              (){ std::vector<uint8_t> v; v.swap( tx_ ); return v; }
+
+                //discard unread rx before writing tx()- replies with no block number
+                //cannot be told apart from a late one to the last try
+                bool
+dropRx          () const { return ! numbered(); }
+
+                //data blocks sent ahead of the acks (1 = stop-and-wait)
+                unsigned
+window          () const { return window_; }
+
+                Time
+deadline        () const { return deadline_; }
+
+                State
+state           () const { return state_; }
+
+                bool
+done            () const { return state_ == Done || state_ == Failed; }
+
+                bool
+ok              () const { return state_ == Done; }
+
+                const std::string&
+error           () const { return error_; }
+
+                //data blocks in the image (stats().blocks is the acked ones)
+                unsigned
+blocks          () const { return blocks_; }
+
+                const SessionStats&
+stats           () const { return stats_; }
+
+                //image bytes acked up to (sparse blocks included)
+                size_t
+position        () const { return position_; }
+
+                //baud step the bootloader is at (BAUD_ADAPT), the port follows it
+                uint8_t
+baudStep        () const { return baudStep_; }
+
+                uint32_t
+baud            () const { return cfg_.baud >> baudStep_; }
+
+                //data block ack wait in use
+                int
+replyMs         () const { return stats_.replyMs( cfg_.replyMs ); }
+
+                //upload part done, now in (or past) the dumps/run app
+                bool
+uploaded        () const { return uploaded_; }
+
+                bool
+appRunning      () const { return appRunning_; }
+
+                const std::vector<DumpRecord>&
+dumps           () const { return dumps_; }
+
+                };
+
+                } //namespace bl
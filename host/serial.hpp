@@ -0,0 +1,152 @@
+/*-----------------------------------------------------------------------------
+    serial port for the host tools (linux only)
+
+    raw 8N1, any baud rate (termios2 BOTHER, so UART_BAUD>>step values like
+    28800 are also possible), optional rts/cts or xon/xoff flow control
+
+    termios2 comes from asm/termbits.h, which cannot be mixed with termios.h
+-----------------------------------------------------------------------------*/
+#pragma once
+
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <linux/serial.h>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <fstream>
+
+                enum class
+Flow            { None, RtsCts, XonXoff };
+
+                class
+Serial          {
+
+                int fd_{ -1 };
+                std::string path_;
+
+public:
+
+Serial          (const std::string& path) : path_(path)
+                {
+                fd_ = ::open( path.c_str(), O_RDWR|O_NOCTTY|O_NONBLOCK );
+                }
+
+~Serial         (){ if( fd_ >= 0 ) ::close( fd_ ); }
+
+Serial          (const Serial&) = delete;
+                Serial&
+operator=       (const Serial&) = delete;
+
+                bool
+ok              () const { return fd_ >= 0; }
+
+                int
+fd              () const { return fd_; }
+
+                bool
+baud            (uint32_t rate, Flow flow = Flow::None)
+                {
+                termios2 t;
+                if( ioctl(fd_, TCGETS2, &t) ) return false;
+                t.c_iflag = (flow == Flow::XonXoff) ? IXON : 0; //ixon- we pause on XOFF
+                t.c_oflag = 0;
+                t.c_lflag = 0;
+                t.c_cflag = CS8|CREAD|CLOCAL|BOTHER;
+                if( flow == Flow::RtsCts ) t.c_cflag |= CRTSCTS;
+                t.c_cc[VSTART] = 0x11;
+                t.c_cc[VSTOP] = 0x13;
+                t.c_cc[VMIN] = 0;
+                t.c_cc[VTIME] = 0;
+                t.c_ispeed = rate;
+                t.c_ospeed = rate;
+                return ioctl(fd_, TCSETS2, &t) == 0;
+                }
+
+                //usb serial- ask the driver to pass rx data on right away (the
+                //ftdi/usb-serial latency_timer defaults to 16ms, which every ack
+                //would wait out), returns what was changed, empty if nothing
+                //(always for cdc-acm- it takes TIOCSSERIAL but ignores low_latency,
+                //and has no latency timer)
+                std::string
+lowLatency      ()
+                {
+                std::string r;
+                if( driver() == "cdc_acm" ) return r;
+                serial_struct ss;
+                if( ioctl(fd_, TIOCGSERIAL, &ss) == 0 && ! (ss.flags & ASYNC_LOW_LATENCY) ){
+                    ss.flags |= ASYNC_LOW_LATENCY;
+                    if( ioctl(fd_, TIOCSSERIAL, &ss) == 0 ) r = "low_latency";
+                    }
+                auto dev = path_.substr( path_.rfind('/')+1 );
+                std::ofstream lt( "/sys/bus/usb-serial/devices/" + dev + "/latency_timer" );
+                if( lt << "1" << std::flush ) r += r.empty() ? "latency_timer=1" : " latency_timer=1";
+                return r;
+                }
+
+                //kernel driver of the port (like cdc_acm, ftdi_sio), empty if unknown
+                std::string
+driver          () const
+                {
+                auto dev = path_.substr( path_.rfind('/')+1 );
+                char buf[256];
+                ssize_t n = readlink( ("/sys/class/tty/" + dev + "/device/driver").c_str(), buf, sizeof buf - 1 );
+                if( n <= 0 ) return "";
+                std::string s( buf, n );
+                return s.substr( s.rfind('/')+1 );
+                }
+
+                //discard any unread rx data
+                void
+flush           (){ ioctl( fd_, TCFLSH, TCIFLUSH ); }
+
+                //wait until all tx data has left the port
+                void
+drain           (){ ioctl( fd_, TCSBRK, 1 ); }
+
+                bool
+write           (const uint8_t* buf, size_t n)
+                {
+                while( n ){
+                    ssize_t r = ::write( fd_, buf, n );
+                    if( r < 0 ){
+                        pollfd p{ fd_, POLLOUT, 0 };
+                        if( ::poll(&p, 1, 1000) <= 0 ) return false;
+                        continue;
+                        }
+                    buf += r; n -= r;
+                    }
+                return true;
+                }
+
+                bool
+write           (uint8_t c){ return write( &c, 1 ); }
+
+                //read up to n bytes, return count read (less than n if timed out)
+                //timeout is for each wait, not the total
+                size_t
+read            (uint8_t* buf, size_t n, int timeoutMs)
+                {
+                size_t count = 0;
+                while( count < n ){
+                    pollfd p{ fd_, POLLIN, 0 };
+                    if( ::poll(&p, 1, timeoutMs) <= 0 ) break;
+                    ssize_t r = ::read( fd_, buf+count, n-count );
+                    if( r <= 0 ) break;
+                    count += r;
+                    }
+                return count;
+                }
+
+                //single byte, -1 if timed out
+                int
+read            (int timeoutMs)
+                {
+                uint8_t c;
+                return read(&c, 1, timeoutMs) ? c : -1;
+                }
+
+                };